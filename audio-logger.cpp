@@ -10,52 +10,136 @@
 
 #include <mutex>
 #include <atomic>
+#include <thread>
+#include <cmath>
+#include <limits>
 #include <algorithm>
 
 namespace {
+    template <typename TSample>
     void cbAudioReady(void * userData, uint8_t * stream, int32_t /*nbytes*/) {
-        AudioLogger * logger = (AudioLogger *)(userData);
-        logger->addFrame((AudioLogger::Sample *)(stream));
+        AudioLoggerT<TSample> * logger = (AudioLoggerT<TSample> *)(userData);
+        logger->addFrame(stream);
+    }
+
+    constexpr int32_t nextPowerOfTwo(int32_t n) {
+        int32_t res = 1;
+        while (res < n) res *= 2;
+        return res;
+    }
+
+    // amplitude that corresponds to 1.0 in float
+    template <typename TSample> constexpr double kFullScale = 1.0;
+    template <> constexpr double kFullScale<TSampleI16> = 32768.0;
+    template <> constexpr double kFullScale<TSampleI32> = 2147483648.0;
+
+    // averages the channels of kSamplesPerFrame interleaved samples and converts them to TDst
+    template <typename TSrc, typename TDst>
+    void mixChannels(const uint8_t * stream, int nChannels, TDst * dst) {
+        const TSrc * src = (const TSrc *)(stream);
+        const double norm = kFullScale<TDst>/(kFullScale<TSrc>*nChannels);
+
+        for (int i = 0; i < kSamplesPerFrame; ++i) {
+            double x = 0;
+            for (int j = 0; j < nChannels; ++j) {
+                x += src[i*nChannels + j];
+            }
+            x *= norm;
+
+            if constexpr (std::is_floating_point<TDst>::value) {
+                dst[i] = x;
+            } else {
+                dst[i] = std::max<double>(std::numeric_limits<TDst>::min(), std::min<double>(std::numeric_limits<TDst>::max(), std::round(x)));
+            }
+        }
     }
 }
 
-struct AudioLogger::Data {
-    Data() : isReady(false) {
+template <typename TSample>
+struct AudioLoggerT<TSample>::Data {
+    // number of frames between the audio thread and the worker - must be a power of 2
+    // room for the longest record, so the worker can spend that long in the callback without losing frames
+    static constexpr int32_t kRingSize_frames = nextPowerOfTwo(getBufferSize_frames(kMaxSampleRate, kMaxBufferSize_s));
+
+    Data() : ringHead(0), ringTail(0), nDropped(0), isReady(false), isRunning(false) {
         for (auto & frame : buffer) {
             frame.fill(0);
         }
 
-        for (auto & record : records) {
-            record.clear();
+        for (auto & frame : ring) {
+            frame.fill(0);
+        }
+
+        ringGap.fill(0);
+        semFrames = SDL_CreateSemaphore(0);
+
+        for (int i = 0; i < kMaxRecords; ++i) {
+            freeRecords[i] = kMaxRecords - 1 - i;
         }
 
         nFramesToRecord.fill(0);
     }
 
+    ~Data() {
+        SDL_DestroySemaphore(semFrames);
+    }
+
     SDL_AudioDeviceID deviceIdIn = 0;
     //SDL_AudioDeviceID deviceIdOut = 0;
 
     int32_t sampleSize_bytes = -1;
-
+    SDL_AudioFormat deviceFormat = 0;
+
+    // single-producer / single-consumer ring with the captured frames
+    // the audio thread only writes ring[ringHead] and the worker only reads ring[ringTail], so neither of them locks
+    // if the worker falls behind, the new frames are dropped instead of blocking the audio thread. ringGap is the
+    // number of frames dropped right before each frame, so that the worker can put silence in their place
+    std::array<Frame, kRingSize_frames> ring;
+    std::array<uint32_t, kRingSize_frames> ringGap;
+    std::atomic<uint64_t> ringHead;
+    std::atomic<uint64_t> ringTail;
+    std::atomic<int64_t> nDropped;
+    uint32_t nDroppedPending = 0;
+
+    // posted by the audio thread for each frame in the ring - posting never blocks
+    SDL_sem * semFrames = nullptr;
+
+    // the rest is used by the worker thread and by record() / pause() under the mutex
     int32_t bufferId = 0;
     std::array<Frame, getBufferSize_frames(kMaxSampleRate, kMaxBufferSize_s)> buffer;
 
-    int32_t nRecords = 0;
-    std::array<int32_t, kMaxRecords> nFramesToRecord;
+    // pool of records with capacity for the longest one (reserved in install()), so recording does not allocate
+    // the ids of the records in progress are in activeRecords, in the order they were requested. a completed record
+    // is passed to the callback and then returned to freeRecords with its capacity intact
     std::array<Record, kMaxRecords> records;
+    std::array<int32_t, kMaxRecords> nFramesToRecord;
+
+    int32_t nRecords = 0;
+    std::array<int32_t, kMaxRecords> activeRecords;
+
+    int32_t nFreeRecords = kMaxRecords;
+    std::array<int32_t, kMaxRecords> freeRecords;
 
     Parameters parameters;
     TFilterCoefficients filterCoefficients;
 
     std::mutex mutex;
     std::atomic_bool isReady;
+
+    std::thread worker;
+    std::atomic_bool isRunning;
 };
 
-AudioLogger::AudioLogger() : data_(new AudioLogger::Data()) {}
+template <typename TSample>
+AudioLoggerT<TSample>::AudioLoggerT() : data_(new AudioLoggerT<TSample>::Data()) {}
 
-AudioLogger::~AudioLogger() {}
+template <typename TSample>
+AudioLoggerT<TSample>::~AudioLoggerT() {
+    stopWorker();
+}
 
-bool AudioLogger::install(Parameters && parameters) {
+template <typename TSample>
+bool AudioLoggerT<TSample>::install(Parameters && parameters) {
     auto & data = getData();
 
     if (parameters.captureId < 0) {
@@ -98,10 +182,14 @@ bool AudioLogger::install(Parameters && parameters) {
     SDL_zero(captureSpec);
 
     captureSpec.freq = parameters.sampleRate;
-    captureSpec.format = AUDIO_F32SYS;
+    switch (parameters.sampleType) {
+        case Parameters::F32SYS: captureSpec.format = AUDIO_F32SYS; break;
+        case Parameters::S16SYS: captureSpec.format = AUDIO_S16SYS; break;
+        case Parameters::S32SYS: captureSpec.format = AUDIO_S32SYS; break;
+    }
     captureSpec.channels = parameters.nChannels;
     captureSpec.samples = kSamplesPerFrame;
-    captureSpec.callback = ::cbAudioReady;
+    captureSpec.callback = ::cbAudioReady<TSample>;
     captureSpec.userdata = this;
 
     SDL_AudioSpec obtainedSpec;
@@ -116,23 +204,28 @@ bool AudioLogger::install(Parameters && parameters) {
     }
 
     switch (obtainedSpec.format) {
-        case AUDIO_U8:
-        case AUDIO_S8:
-        case AUDIO_U16SYS:
         case AUDIO_S16SYS:
-        case AUDIO_S32SYS:
             {
-                fprintf(stderr, "error : unsupported sample format %d\n", obtainedSpec.format);
-                return false;
+                data.sampleSize_bytes = 2;
             }
             break;
+        case AUDIO_S32SYS:
         case AUDIO_F32SYS:
             {
                 data.sampleSize_bytes = 4;
             }
             break;
+        default:
+            {
+                fprintf(stderr, "error : unsupported sample format %d\n", obtainedSpec.format);
+                SDL_CloseAudioDevice(data.deviceIdIn);
+                return false;
+            }
+            break;
     }
 
+    data.deviceFormat = obtainedSpec.format;
+
     printf("Opened capture device succesfully!\n");
     printf("    Frequency:  %d\n", obtainedSpec.freq);
     printf("    Format:     %d (%d bytes)\n", obtainedSpec.format, data.sampleSize_bytes);
@@ -144,8 +237,6 @@ bool AudioLogger::install(Parameters && parameters) {
                obtainedSpec.channels, parameters.nChannels);
     }
 
-    SDL_PauseAudioDevice(data.deviceIdIn, 0);
-
     parameters.nChannels = obtainedSpec.channels;
 
     switch (parameters.filter) {
@@ -165,9 +256,17 @@ bool AudioLogger::install(Parameters && parameters) {
             break;
     };
 
+    for (auto & record : data.records) {
+        record.reserve(getBufferSize_frames(parameters.sampleRate, kMaxBufferSize_s));
+    }
+
     data.parameters = parameters;
     data.isReady = true;
 
+    startWorker();
+
+    SDL_PauseAudioDevice(data.deviceIdIn, 0);
+
     // print filter paramters
     printf("    Audio Filter: %d\n", parameters.filter);
     printf("    Cutoff frequency: %g Hz\n", parameters.freqCutoff_Hz);
@@ -176,37 +275,54 @@ bool AudioLogger::install(Parameters && parameters) {
     return true;
 }
 
-bool AudioLogger::terminate() {
+template <typename TSample>
+bool AudioLoggerT<TSample>::terminate() {
     auto & data = getData();
 
     SDL_PauseAudioDevice(data.deviceIdIn, 1);
     SDL_CloseAudioDevice(data.deviceIdIn);
 
+    stopWorker();
+
     return true;
 }
 
-bool AudioLogger::addFrame(const Sample * stream) {
+template <typename TSample>
+bool AudioLoggerT<TSample>::addFrame(const uint8_t * stream) {
     auto & data = getData();
 
     if (data.isReady == false) return false;
 
-	if (SDL_GetQueuedAudioSize(data.deviceIdIn) > 32*sizeof(float)*kSamplesPerFrame) {
-		printf("Queue size: %d\n", SDL_GetQueuedAudioSize(data.deviceIdIn));
-		SDL_ClearQueuedAudio(data.deviceIdIn);
-	}
+    // called on the audio thread - it must not block or allocate
+    const uint64_t head = data.ringHead.load(std::memory_order_relaxed);
+    if (head - data.ringTail.load(std::memory_order_acquire) >= Data::kRingSize_frames) {
+        data.nDropped.fetch_add(1, std::memory_order_relaxed);
+        ++data.nDroppedPending;
+        return false;
+    }
 
-    const float norm = 1.0/data.parameters.nChannels;
+    const int nChannels = data.parameters.nChannels;
 
-    auto & curFrame = data.buffer[data.bufferId];
+    auto & curFrame = data.ring[head & (Data::kRingSize_frames - 1)];
+    data.ringGap[head & (Data::kRingSize_frames - 1)] = data.nDroppedPending;
+    data.nDroppedPending = 0;
 
-    for (int i = 0; i < kSamplesPerFrame; ++i) {
-        Sample x = 0;
-        for (int j = 0; j < data.parameters.nChannels; ++j) {
-            x += stream[i*data.parameters.nChannels + j];
-        }
-        curFrame[i] = x*norm;
+    switch (data.deviceFormat) {
+        case AUDIO_S16SYS: ::mixChannels<TSampleI16>(stream, nChannels, curFrame.data()); break;
+        case AUDIO_S32SYS: ::mixChannels<TSampleI32>(stream, nChannels, curFrame.data()); break;
+        default:           ::mixChannels<TSampleF>  (stream, nChannels, curFrame.data()); break;
     }
 
+    data.ringHead.store(head + 1, std::memory_order_release);
+    SDL_SemPost(data.semFrames);
+
+    return true;
+}
+
+template <typename TSample>
+bool AudioLoggerT<TSample>::processFrame(Frame & curFrame) {
+    auto & data = getData();
+
     switch (data.parameters.filter) {
         case EAudioFilter::None:
             {
@@ -228,36 +344,124 @@ bool AudioLogger::addFrame(const Sample * stream) {
             break;
     }
 
-    std::lock_guard<std::mutex> lock(data.mutex);
+    // the completed records are passed to the callback after the mutex is released, so it can call record()
+    int nCompleted = 0;
+    std::array<int32_t, kMaxRecords> completed;
 
-    for (int r = 0; r < data.nRecords; ++r) {
-        auto & record = data.records[r];
-        auto & nFramesToRecord = data.nFramesToRecord[r];
-
-        if (nFramesToRecord > 0) {
-            record.push_back(curFrame);
-            if (--nFramesToRecord == 0) {
-                if (data.parameters.callback) data.parameters.callback(record);
-                record.clear();
-
-                for (int k = r + 1; k < data.nRecords; ++k) {
-                    data.records[k - 1] = std::move(data.records[k]);
-                    data.nFramesToRecord[k - 1] = data.nFramesToRecord[k];
-                }
-                --data.nRecords;
-                --r;
+    {
+        std::lock_guard<std::mutex> lock(data.mutex);
+
+        data.buffer[data.bufferId] = curFrame;
+
+        int nActive = 0;
+        for (int r = 0; r < data.nRecords; ++r) {
+            const auto id = data.activeRecords[r];
+
+            data.records[id].push_back(curFrame);
+            if (--data.nFramesToRecord[id] == 0) {
+                completed[nCompleted++] = id;
+            } else {
+                data.activeRecords[nActive++] = id;
             }
         }
+        data.nRecords = nActive;
+
+        if (++data.bufferId >= (int) data.buffer.size()) {
+            data.bufferId = 0;
+        }
     }
 
-    if (++data.bufferId >= (int) data.buffer.size()) {
-        data.bufferId = 0;
+    if (nCompleted == 0) {
+        return true;
+    }
+
+    if (data.parameters.callback) {
+        for (int i = 0; i < nCompleted; ++i) {
+            data.parameters.callback(data.records[completed[i]]);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(data.mutex);
+
+        for (int i = 0; i < nCompleted; ++i) {
+            data.records[completed[i]].clear();
+            data.freeRecords[data.nFreeRecords++] = completed[i];
+        }
     }
 
     return true;
 }
 
-bool AudioLogger::record(float bufferSize_s, int32_t nPrevFrames) {
+template <typename TSample>
+bool AudioLoggerT<TSample>::startWorker() {
+    auto & data = getData();
+
+    if (data.worker.joinable()) {
+        return false;
+    }
+
+    data.isRunning = true;
+    data.worker = std::thread([this]() {
+        auto & data = getData();
+
+        int64_t nDroppedReported = 0;
+        while (true) {
+            const bool isRunning = data.isRunning;
+
+            const uint64_t tail = data.ringTail.load(std::memory_order_relaxed);
+            if (tail == data.ringHead.load(std::memory_order_acquire)) {
+                if (isRunning == false) break;
+
+                // woken up by the next frame or by stopWorker()
+                SDL_SemWait(data.semFrames);
+                continue;
+            }
+
+            // the lost frames are replaced with silence, so that the records and the history buffer stay aligned in
+            // time and the records keep their length. beyond the size of the history buffer, it is silence anyway
+            {
+                const int64_t nGap = std::min<int64_t>(data.ringGap[tail & (Data::kRingSize_frames - 1)], data.buffer.size());
+                for (int64_t i = 0; i < nGap; ++i) {
+                    Frame silence;
+                    silence.fill(0);
+                    processFrame(silence);
+                }
+            }
+
+            processFrame(data.ring[tail & (Data::kRingSize_frames - 1)]);
+
+            data.ringTail.store(tail + 1, std::memory_order_release);
+
+            const int64_t nDropped = data.nDropped.load(std::memory_order_relaxed);
+            if (nDropped != nDroppedReported) {
+                fprintf(stderr, "warning : audio frames dropped and replaced with silence - %d so far\n", (int) nDropped);
+                nDroppedReported = nDropped;
+            }
+        }
+    });
+
+    return true;
+}
+
+template <typename TSample>
+bool AudioLoggerT<TSample>::stopWorker() {
+    auto & data = getData();
+
+    if (data.worker.joinable() == false) {
+        return false;
+    }
+
+    // the frames that are already captured are processed before the worker exits
+    data.isRunning = false;
+    SDL_SemPost(data.semFrames);
+    data.worker.join();
+
+    return true;
+}
+
+template <typename TSample>
+bool AudioLoggerT<TSample>::record(float bufferSize_s, int32_t nPrevFrames) {
     auto & data = getData();
 
     if (isValidBufferSize(bufferSize_s) == false) {
@@ -273,45 +477,54 @@ bool AudioLogger::record(float bufferSize_s, int32_t nPrevFrames) {
 
     std::lock_guard<std::mutex> lock(data.mutex);
 
-    if (data.nRecords == kMaxRecords) {
+    if (data.nFreeRecords == 0) {
         fprintf(stderr, "warning : max number of simultaneous records %d reached\n", kMaxRecords);
         return false;
     }
 
-    auto & record = data.records[data.nRecords];
+    const auto id = data.freeRecords[--data.nFreeRecords];
+    auto & record = data.records[id];
 
-    if (record.size() == 0) {
-        int fStart = data.bufferId - nPrevFrames;
-        if (fStart < 0) fStart += data.buffer.size();
-        for (int i = 0; i < nPrevFrames; ++i) {
-            record.push_back(data.buffer[(fStart + i)%data.buffer.size()]);
-        }
-    } else {
-        fprintf(stderr, "warning : new record requested before last has been processed. should never happen\n");
+    int fStart = data.bufferId - nPrevFrames;
+    if (fStart < 0) fStart += data.buffer.size();
+    for (int i = 0; i < nPrevFrames; ++i) {
+        record.push_back(data.buffer[(fStart + i)%data.buffer.size()]);
     }
 
-    data.nFramesToRecord[data.nRecords] = bufferSize_frames - nPrevFrames;
-
-    ++data.nRecords;
+    data.nFramesToRecord[id] = bufferSize_frames - nPrevFrames;
+    data.activeRecords[data.nRecords++] = id;
 
     return true;
 }
 
-bool AudioLogger::pause() {
+template <typename TSample>
+bool AudioLoggerT<TSample>::pause() {
     auto & data = getData();
     SDL_PauseAudioDevice(data.deviceIdIn, 1);
-    data.nFramesToRecord.fill(0);
+
+    // the records in progress are discarded
+    std::lock_guard<std::mutex> lock(data.mutex);
+    for (int r = 0; r < data.nRecords; ++r) {
+        const auto id = data.activeRecords[r];
+
+        data.records[id].clear();
+        data.nFramesToRecord[id] = 0;
+        data.freeRecords[data.nFreeRecords++] = id;
+    }
+    data.nRecords = 0;
 
     return true;
 }
 
-bool AudioLogger::resume() {
+template <typename TSample>
+bool AudioLoggerT<TSample>::resume() {
     auto & data = getData();
     SDL_PauseAudioDevice(data.deviceIdIn, 0);
     return true;
 }
 
-bool AudioLogger::isValidBufferSize(float bufferSize_s) const {
+template <typename TSample>
+bool AudioLoggerT<TSample>::isValidBufferSize(float bufferSize_s) const {
     if (bufferSize_s <= 0) {
         fprintf(stderr, "error : invalid bufferSize_s = %g\n", bufferSize_s);
         return false;
@@ -324,3 +537,7 @@ bool AudioLogger::isValidBufferSize(float bufferSize_s) const {
 
     return true;
 }
+
+template class AudioLoggerT<TSampleF>;
+template class AudioLoggerT<TSampleI16>;
+template class AudioLoggerT<TSampleI32>;
@@ -16,10 +16,14 @@
 #include <array>
 #include <vector>
 #include <functional>
+#include <type_traits>
 
-class AudioLogger {
+// TSample is the type of the captured samples - TSampleF, TSampleI16 or TSampleI32
+// the integer types are full-scale, so an int16 pipeline can use the frames directly, without a float copy
+template <typename TSample>
+class AudioLoggerT {
     public:
-        using Sample = TSampleF;
+        using Sample = TSample;
 
         using Frame = std::array<Sample, kSamplesPerFrame>;
         using Record = std::vector<Frame>;
@@ -35,12 +39,17 @@ class AudioLogger {
 
             // Sample Type
 
-            // todo : support for other sample types
+            // format requested from the capture device - converted to Sample if different
+            // by default, the one that matches Sample, so the samples are only copied
             enum ESampleType {
                 F32SYS,
+                S16SYS,
+                S32SYS,
             };
 
-            ESampleType sampleType = F32SYS;
+            ESampleType sampleType =
+                std::is_same<Sample, TSampleI16>::value ? S16SYS :
+                std::is_same<Sample, TSampleI32>::value ? S32SYS : F32SYS;
 
             // Audio Filter
 
@@ -49,12 +58,15 @@ class AudioLogger {
             float freqCutoff_Hz = 1000.0f;
         };
 
-        AudioLogger();
-        ~AudioLogger();
+        AudioLoggerT();
+        ~AudioLoggerT();
 
         bool install(Parameters && parameters);
         bool terminate();
-        bool addFrame(const Sample * stream);
+
+        // called from the audio thread with the samples in the format of the device
+        // only converts the frame to a lock-free ring and wakes up the worker - it never blocks
+        bool addFrame(const uint8_t * stream);
         bool record(float bufferSize_s, int32_t nPrevFrames);
 
         bool pause();
@@ -63,8 +75,17 @@ class AudioLogger {
         bool isValidBufferSize(float bufferSize_s) const;
 
     private:
+        // the captured frames are filtered and assembled into records on a worker thread, which also invokes the callback
+        bool processFrame(Frame & frame);
+        bool startWorker();
+        bool stopWorker();
+
         struct Data;
         std::unique_ptr<Data> data_;
         Data & getData() { return *data_; }
         const Data & getData() const { return *data_; }
 };
+
+using AudioLogger    = AudioLoggerT<TSampleF>;
+using AudioLoggerI16 = AudioLoggerT<TSampleI16>;
+using AudioLoggerI32 = AudioLoggerT<TSampleI32>;
@@ -0,0 +1,5 @@
+#pragma once
+
+const char * kGIT_SHA1 = "34d4d457";
+const char * kGIT_DATE = "Sun Oct 18 06:57:11 2026";
+const char * kGIT_COMMIT_SUBJECT = "baseline";
@@ -14,6 +14,11 @@
 #include <algorithm>
 #include <condition_variable>
 
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #ifndef pi
 #define  pi 3.1415926535897932384626433832795
 #endif
@@ -88,6 +93,69 @@ std::map<std::string, std::string> parseCmdArguments(int argc, char ** argv) {
     return res;
 }
 
+template <typename T>
+std::vector<T> calcQuantizationCodebook(std::vector<T> values, int nLevels, double & maxError) {
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+
+    maxError = 0.0;
+    if ((int) values.size() <= nLevels) {
+        return values;
+    }
+
+    // number of intervals of width 2*eps needed to cover all values - greedy is optimal in 1D
+    auto calcLevels = [&](double eps) {
+        int res = 0;
+        for (int i = 0; i < (int) values.size(); ) {
+            const double end = (double) values[i] + 2.0*eps;
+            while (i < (int) values.size() && values[i] <= end) ++i;
+            ++res;
+        }
+        return res;
+    };
+
+    double eps0 = 0.0;
+    double eps1 = 0.5*((double) values.back() - (double) values.front());
+    for (int iter = 0; iter < 64; ++iter) {
+        const double eps = 0.5*(eps0 + eps1);
+        if (calcLevels(eps) <= nLevels) {
+            eps1 = eps;
+        } else {
+            eps0 = eps;
+        }
+    }
+
+    // place each level in the middle of the values it covers
+    std::vector<T> res;
+    for (int i = 0; i < (int) values.size(); ) {
+        const auto i0 = i;
+        const double end = (double) values[i] + 2.0*eps1;
+        while (i < (int) values.size() && values[i] <= end) ++i;
+        res.push_back(0.5*((double) values[i0] + (double) values[i - 1]));
+    }
+
+    for (const auto & v : values) {
+        maxError = std::max(maxError, std::fabs((double) v - (double) res[quantize(v, res)]));
+    }
+
+    return res;
+}
+
+template std::vector<float> calcQuantizationCodebook<float>(std::vector<float> values, int nLevels, double & maxError);
+template std::vector<double> calcQuantizationCodebook<double>(std::vector<double> values, int nLevels, double & maxError);
+
+template <typename T>
+int32_t quantize(T value, const std::vector<T> & codebook) {
+    const int32_t i = std::lower_bound(codebook.begin(), codebook.end(), value) - codebook.begin();
+    if (i == 0) return 0;
+    if (i == (int32_t) codebook.size()) return i - 1;
+
+    return value - codebook[i - 1] <= codebook[i] - value ? i - 1 : i;
+}
+
+template int32_t quantize<float>(float value, const std::vector<float> & codebook);
+template int32_t quantize<double>(double value, const std::vector<double> & codebook);
+
 template <typename TSampleSrc, typename TSampleDst>
 bool convert(const TWaveformT<TSampleSrc> & src, TWaveformT<TSampleDst> & dst) {
     static_assert(std::is_same<TSampleSrc, TSampleDst>::value == false, "Required different sample types");
@@ -106,8 +174,35 @@ bool convert(const TWaveformT<TSampleSrc> & src, TWaveformT<TSampleDst> & dst) {
 
 template bool convert<TSampleF, TSampleI16>(const TWaveformT<TSampleF> & src, TWaveformT<TSampleI16> & dst);
 
+template <typename TSampleSrc, typename TSampleDst>
+bool convert(const TWaveformT<TSampleSrc> & src, TWaveformT<TSampleDst> & dst, int64_t offset, double scale) {
+    static_assert(std::is_same<TSampleSrc, TSampleF>::value, "Source sample type not supported");
+    static_assert(std::is_same<TSampleDst, TSampleI16>::value, "Destination sample type not supported");
+
+    if (offset < 0 || offset > (int64_t) src.size() || offset > (int64_t) dst.size()) {
+        return false;
+    }
+
+    dst.resize(src.size());
+
+    const double vmax = std::numeric_limits<TSampleDst>::max();
+    for (int64_t i = offset; i < (int64_t) src.size(); ++i) {
+        dst[i] = std::round(std::max(-vmax, std::min(vmax, vmax*scale*src[i])));
+    }
+
+    return true;
+}
+
+template bool convert<TSampleF, TSampleI16>(const TWaveformT<TSampleF> & src, TWaveformT<TSampleI16> & dst, int64_t offset, double scale);
+
 template <typename TSample>
 void filter(TWaveformT<TSample> & waveform, EAudioFilter filter, float freqCutoff_Hz, int64_t sampleRate) {
+    auto filterCoefficients = ::calculateCoefficients(filter, freqCutoff_Hz, sampleRate);
+    ::filter(waveform, 0, filter, filterCoefficients);
+}
+
+template <typename TSample>
+void filter(TWaveformT<TSample> & waveform, int64_t offset, EAudioFilter filter, TFilterCoefficients & coefficients) {
     switch (filter) {
         case EAudioFilter::None:
             {
@@ -116,18 +211,16 @@ void filter(TWaveformT<TSample> & waveform, EAudioFilter filter, float freqCutof
             break;
         case EAudioFilter::FirstOrderHighPass:
             {
-                auto filterCoefficients = ::calculateCoefficientsFirstOrderHighPass(freqCutoff_Hz, sampleRate);
-                for (auto & s : waveform) {
-                    s = ::filterFirstOrderHighPass(filterCoefficients, s);
+                for (int64_t i = offset; i < (int64_t) waveform.size(); ++i) {
+                    waveform[i] = ::filterFirstOrderHighPass(coefficients, waveform[i]);
                 }
                 return;
             }
             break;
         case EAudioFilter::SecondOrderButterworthHighPass:
             {
-                auto filterCoefficients = ::calculateCoefficientsSecondOrderButterworthHighPass(freqCutoff_Hz, sampleRate);
-                for (auto & s : waveform) {
-                    s = ::filterSecondOrderButterworthHighPass(filterCoefficients, s);
+                for (int64_t i = offset; i < (int64_t) waveform.size(); ++i) {
+                    waveform[i] = ::filterSecondOrderButterworthHighPass(coefficients, waveform[i]);
                 }
                 return;
             }
@@ -138,6 +231,9 @@ void filter(TWaveformT<TSample> & waveform, EAudioFilter filter, float freqCutof
 }
 
 template void filter<TSampleF>(TWaveformT<TSampleF> & waveform, EAudioFilter filter, float freqCutoff_Hz, int64_t sampleRate);
+template void filter<TSampleF>(TWaveformT<TSampleF> & waveform, int64_t offset, EAudioFilter filter, TFilterCoefficients & coefficients);
+template void filter<TSampleI16>(TWaveformT<TSampleI16> & waveform, EAudioFilter filter, float freqCutoff_Hz, int64_t sampleRate);
+template void filter<TSampleI16>(TWaveformT<TSampleI16> & waveform, int64_t offset, EAudioFilter filter, TFilterCoefficients & coefficients);
 
 template <typename TSample>
 double calcAbsMax(const TWaveformT<TSample> & waveform) {
@@ -239,6 +335,32 @@ bool readFromFile(const std::string & fname, TWaveformT<TSample> & res, TTrainKe
 
 template bool readFromFile<TSampleF, TSampleI16>(const std::string & fname, TWaveformT<TSampleI16> & res, TTrainKeys & trainKeys, int32_t & bufferSize_frames);
 
+template <typename TSampleInput>
+int64_t readFromStream(std::istream & fin, TWaveformF & res, int64_t nSamples) {
+    static_assert(std::is_same<TSampleInput, TSampleF>::value ||
+                  std::is_same<TSampleInput, TSampleI16>::value, "TSampleInput not supported");
+
+    std::vector<TSampleInput> buf(nSamples);
+    fin.read((char *)(buf.data()), nSamples*sizeof(TSampleInput));
+
+    // drop a trailing partial sample, if any
+    const int64_t nRead = fin.gcount()/sizeof(TSampleInput);
+
+    const auto offset = res.size();
+    res.resize(offset + nRead);
+    if (std::is_same<TSampleInput, TSampleI16>::value) {
+        const float iscale = 1.0f/std::numeric_limits<TSampleI16>::max();
+        for (int64_t i = 0; i < nRead; ++i) res[offset + i] = buf[i]*iscale;
+    } else {
+        for (int64_t i = 0; i < nRead; ++i) res[offset + i] = buf[i];
+    }
+
+    return nRead;
+}
+
+template int64_t readFromStream<TSampleF>(std::istream & fin, TWaveformF & res, int64_t nSamples);
+template int64_t readFromStream<TSampleI16>(std::istream & fin, TWaveformF & res, int64_t nSamples);
+
 //
 // filters
 //
@@ -246,8 +368,8 @@ template bool readFromFile<TSampleF, TSampleI16>(const std::string & fname, TWav
 TFilterCoefficients calculateCoefficientsFirstOrderHighPass(int fc, int fs) {
     TFilterCoefficients res;
 
-    float th = 2.0 * pi * fc / fs;
-    float g = cos(th) / (1.0 + sin(th));
+    double th = 2.0 * pi * fc / fs;
+    double g = cos(th) / (1.0 + sin(th));
     res.a0 = (1.0 + g) / 2.0;
     res.a1 = -((1.0 + g) / 2.0);
     res.a2 = 0.0;
@@ -260,7 +382,7 @@ TFilterCoefficients calculateCoefficientsFirstOrderHighPass(int fc, int fs) {
 TFilterCoefficients calculateCoefficientsSecondOrderButterworthHighPass(int fc, int fs) {
     TFilterCoefficients res;
 
-    float c = tan(pi*fc / fs);
+    double c = tan(pi*fc / fs);
     res.a0 = 1.0 / (1.0 + sqrt2*c + pow(c, 2.0));
     res.a1 = -2.0 * res.a0;
     res.a2 = res.a0;
@@ -270,9 +392,24 @@ TFilterCoefficients calculateCoefficientsSecondOrderButterworthHighPass(int fc,
     return res;
 }
 
-TSampleF filterFirstOrderHighPass(TFilterCoefficients & coefficients, TSampleF sample) {
-    TSampleF xn = sample;
-    TSampleF yn =
+TFilterCoefficients calculateCoefficients(EAudioFilter filter, int fc, int fs) {
+    switch (filter) {
+        case EAudioFilter::None:
+            break;
+        case EAudioFilter::FirstOrderHighPass:
+            return calculateCoefficientsFirstOrderHighPass(fc, fs);
+        case EAudioFilter::SecondOrderButterworthHighPass:
+            return calculateCoefficientsSecondOrderButterworthHighPass(fc, fs);
+    }
+
+    return {};
+}
+
+namespace {
+
+// direct form I biquad - both filters differ only in their coefficients
+double filterBiquad(TFilterCoefficients & coefficients, double xn) {
+    double yn =
         coefficients.a0*xn + coefficients.a1*coefficients.xnz1 + coefficients.a2*coefficients.xnz2 -
                              coefficients.b1*coefficients.ynz1 - coefficients.b2*coefficients.ynz2;
 
@@ -284,20 +421,34 @@ TSampleF filterFirstOrderHighPass(TFilterCoefficients & coefficients, TSampleF s
     return yn;
 }
 
+}
+
+TSampleF filterFirstOrderHighPass(TFilterCoefficients & coefficients, TSampleF sample) {
+    return filterBiquad(coefficients, sample);
+}
+
 TSampleF filterSecondOrderButterworthHighPass(TFilterCoefficients & coefficients, TSampleF sample) {
-    TSampleF xn = sample;
-    TSampleF yn =
-        coefficients.a0*xn + coefficients.a1*coefficients.xnz1 + coefficients.a2*coefficients.xnz2 -
-                             coefficients.b1*coefficients.ynz1 - coefficients.b2*coefficients.ynz2;
+    return filterBiquad(coefficients, sample);
+}
 
-    coefficients.xnz2 = coefficients.xnz1;
-    coefficients.xnz1 = xn;
-    coefficients.ynz2 = coefficients.ynz1;
-    coefficients.ynz1 = yn;
+template <typename TSample>
+TSample filterFirstOrderHighPass(TFilterCoefficients & coefficients, TSample sample) {
+    const double yn = std::round(filterBiquad(coefficients, sample));
+    return std::max<double>(std::numeric_limits<TSample>::min(), std::min<double>(std::numeric_limits<TSample>::max(), yn));
+}
 
-    return yn;
+template TSampleI16 filterFirstOrderHighPass<TSampleI16>(TFilterCoefficients & coefficients, TSampleI16 sample);
+template TSampleI32 filterFirstOrderHighPass<TSampleI32>(TFilterCoefficients & coefficients, TSampleI32 sample);
+
+template <typename TSample>
+TSample filterSecondOrderButterworthHighPass(TFilterCoefficients & coefficients, TSample sample) {
+    const double yn = std::round(filterBiquad(coefficients, sample));
+    return std::max<double>(std::numeric_limits<TSample>::min(), std::min<double>(std::numeric_limits<TSample>::max(), yn));
 }
 
+template TSampleI16 filterSecondOrderButterworthHighPass<TSampleI16>(TFilterCoefficients & coefficients, TSampleI16 sample);
+template TSampleI32 filterSecondOrderButterworthHighPass<TSampleI32>(TFilterCoefficients & coefficients, TSampleI32 sample);
+
 //
 // calcCC
 //
@@ -605,81 +756,106 @@ template std::tuple<TValueCC, TOffset> findBestCC<TSampleI16>(
 // calculateSimilarityMap
 //
 
-template<>
-bool calculateSimilartyMap(
-        const int32_t keyPressWidth_samples,
-        const int32_t alignWindow_samples,
-        const int32_t offsetFromPeak_samples,
-        TKeyPressCollectionT<TSampleMI16> & keyPresses,
-        TSimilarityMap & res) {
-    int nPresses = keyPresses.size();
-
-    int w = keyPressWidth_samples;
-    int a = alignWindow_samples;
-
-    res.clear();
-    res.resize(nPresses);
-    for (auto & x : res) x.resize(nPresses);
-
-    int nFinished = 0;
+namespace {
+    // computes the rows of res on all cores - res must already have nPresses x nPresses entries
+    // if idxOld is not empty, the pairs of key presses with idxOld != -1 are copied from resOld instead of recomputed
+    template<typename T>
+    void calculateSimilarityMapRows(
+            const int32_t keyPressWidth_samples,
+            const int32_t alignWindow_samples,
+            const int32_t offsetFromPeak_samples,
+            TKeyPressCollectionT<T> & keyPresses,
+            const TSimilarityMap & resOld,
+            const std::vector<int> & idxOld,
+            TSimilarityMap & res) {
+        int nPresses = keyPresses.size();
+
+        int w = keyPressWidth_samples;
+        int a = alignWindow_samples;
+
+        int nFinished = 0;
 #ifdef __EMSCRIPTEN__
-    int nWorkers = std::max(1, std::min(4, int(std::thread::hardware_concurrency()) - 4));
+        int nWorkers = std::max(1, std::min(4, int(std::thread::hardware_concurrency()) - 4));
 #else
-    int nWorkers = std::thread::hardware_concurrency();
+        int nWorkers = std::thread::hardware_concurrency();
 #endif
 
-    std::mutex mutex;
-    std::condition_variable cv;
-    std::vector<std::thread> workers(nWorkers);
-    for (int iw = 0; iw < (int) workers.size(); ++iw) {
-        auto & worker = workers[iw];
-        worker = std::thread([&](int ith) {
-            for (int i = ith; i < nPresses; i += nWorkers) {
-                res[i][i].cc = 1.0f;
-                res[i][i].offset = 0;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<std::thread> workers(nWorkers);
+        for (int iw = 0; iw < (int) workers.size(); ++iw) {
+            auto & worker = workers[iw];
+            worker = std::thread([&](int ith) {
+                for (int i = ith; i < nPresses; i += nWorkers) {
+                    res[i][i].cc = 1.0f;
+                    res[i][i].offset = 0;
 
-                const auto & waveform0 = keyPresses[i].waveform;
-                const auto & pos0      = keyPresses[i].pos;
+                    const auto & waveform0 = keyPresses[i].waveform;
+                    const auto & pos0      = keyPresses[i].pos;
 
-                auto & avgcc = keyPresses[i].ccAvg;
+                    auto & avgcc = keyPresses[i].ccAvg;
+                    avgcc = 0.0;
 
-                const auto samples0 = waveform0.samples;
+                    const auto samples0 = waveform0.samples;
 
-                for (int j = i + 1; j < nPresses; ++j) {
-                    if (i == j) continue;
+                    for (int j = i + 1; j < nPresses; ++j) {
+                        if (idxOld.empty() == false && idxOld[i] != -1 && idxOld[j] != -1) {
+                            res[i][j] = resOld[idxOld[i]][idxOld[j]];
+                            res[j][i] = resOld[idxOld[j]][idxOld[i]];
 
-                    const auto waveform1 = keyPresses[j].waveform;
-                    const auto pos1      = keyPresses[j].pos;
+                            avgcc += res[i][j].cc;
+                            continue;
+                        }
 
-                    const auto samples1 = waveform1.samples;
-                    const auto ret = findBestCC(TWaveformViewT<TSampleMI16> { samples0 + pos0 + offsetFromPeak_samples - w,     2*w },
-                                                TWaveformViewT<TSampleMI16> { samples1 + pos1 + offsetFromPeak_samples - w - a, 2*w + 2*a }, a);
+                        const auto waveform1 = keyPresses[j].waveform;
+                        const auto pos1      = keyPresses[j].pos;
 
-                    const auto bestcc     = std::get<0>(ret);
-                    const auto bestoffset = std::get<1>(ret);
+                        const auto samples1 = waveform1.samples;
+                        const auto ret = findBestCC(TWaveformViewT<T> { samples0 + pos0 + offsetFromPeak_samples - w,     2*w },
+                                                    TWaveformViewT<T> { samples1 + pos1 + offsetFromPeak_samples - w - a, 2*w + 2*a }, a);
 
-                    res[i][j].cc = bestcc;
-                    res[i][j].offset = bestoffset;
+                        const auto bestcc     = std::get<0>(ret);
+                        const auto bestoffset = std::get<1>(ret);
 
-                    res[j][i].cc = bestcc;
-                    res[j][i].offset = -bestoffset;
+                        res[i][j].cc = bestcc;
+                        res[i][j].offset = bestoffset;
 
-                    avgcc += bestcc;
+                        res[j][i].cc = bestcc;
+                        res[j][i].offset = -bestoffset;
+
+                        avgcc += bestcc;
+                    }
+                    avgcc /= (nPresses - 1);
                 }
-                avgcc /= (nPresses - 1);
-            }
 
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                ++nFinished;
-                cv.notify_one();
-            }
-        }, iw);
-        worker.detach();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++nFinished;
+                    cv.notify_one();
+                }
+            }, iw);
+            worker.detach();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return nFinished == nWorkers; });
     }
+}
+
+template<>
+bool calculateSimilartyMap(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        TKeyPressCollectionT<TSampleMI16> & keyPresses,
+        TSimilarityMap & res) {
+    int nPresses = keyPresses.size();
+
+    res.clear();
+    res.resize(nPresses);
+    for (auto & x : res) x.resize(nPresses);
 
-    std::unique_lock<std::mutex> lock(mutex);
-    cv.wait(lock, [&]() { return nFinished == nWorkers; });
+    calculateSimilarityMapRows(keyPressWidth_samples, alignWindow_samples, offsetFromPeak_samples, keyPresses, {}, {}, res);
 
     return true;
 }
@@ -693,80 +869,65 @@ bool calculateSimilartyMap(
         TSimilarityMap & res) {
     int nPresses = keyPresses.size();
 
-    int w = keyPressWidth_samples;
-    int a = alignWindow_samples;
-
     res.clear();
     res.resize(nPresses);
     for (auto & x : res) x.resize(nPresses);
 
-    int nFinished = 0;
-#ifdef __EMSCRIPTEN__
-    int nWorkers = std::max(1, std::min(4, int(std::thread::hardware_concurrency()) - 4));
-#else
-    int nWorkers = std::thread::hardware_concurrency();
-#endif
-
-    std::mutex mutex;
-    std::condition_variable cv;
-    std::vector<std::thread> workers(nWorkers);
-    for (int iw = 0; iw < (int) workers.size(); ++iw) {
-        auto & worker = workers[iw];
-        worker = std::thread([&](int ith) {
-            for (int i = ith; i < nPresses; i += nWorkers) {
-                res[i][i].cc = 1.0f;
-                res[i][i].offset = 0;
-
-                const auto & waveform0 = keyPresses[i].waveform;
-                const auto & pos0      = keyPresses[i].pos;
-
-                auto & avgcc = keyPresses[i].ccAvg;
-
-                const auto samples0 = waveform0.samples;
+    calculateSimilarityMapRows(keyPressWidth_samples, alignWindow_samples, offsetFromPeak_samples, keyPresses, {}, {}, res);
 
-                for (int j = i + 1; j < nPresses; ++j) {
-                    if (i == j) continue;
-
-                    const auto waveform1 = keyPresses[j].waveform;
-                    const auto pos1      = keyPresses[j].pos;
+    return true;
+}
 
-                    const auto samples1 = waveform1.samples;
-                    const auto ret = findBestCC(TWaveformViewT<T> { samples0 + pos0 + offsetFromPeak_samples - w,     2*w },
-                                                TWaveformViewT<T> { samples1 + pos1 + offsetFromPeak_samples - w - a, 2*w + 2*a }, a);
+template bool calculateSimilartyMap<TSampleI16>(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        TKeyPressCollectionT<TSampleI16> & keyPresses,
+        TSimilarityMap & res);
 
-                    const auto bestcc     = std::get<0>(ret);
-                    const auto bestoffset = std::get<1>(ret);
+template<typename T>
+bool updateSimilarityMap(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        const TKeyPressCollectionT<T> & keyPressesOld,
+        TKeyPressCollectionT<T> & keyPresses,
+        TSimilarityMap & res) {
+    int nPresses = keyPresses.size();
+    int nPressesOld = keyPressesOld.size();
 
-                    res[i][j].cc = bestcc;
-                    res[i][j].offset = bestoffset;
+    if ((int) res.size() != nPressesOld) {
+        return false;
+    }
 
-                    res[j][i].cc = bestcc;
-                    res[j][i].offset = -bestoffset;
+    // key presses are sorted by position, so match the old and the new ones in a single pass
+    std::vector<int> idxOld(nPresses, -1);
+    for (int i = 0, j = 0; i < nPresses && j < nPressesOld; ) {
+        if (keyPresses[i].pos == keyPressesOld[j].pos) {
+            idxOld[i++] = j++;
+        } else if (keyPresses[i].pos < keyPressesOld[j].pos) {
+            ++i;
+        } else {
+            ++j;
+        }
+    }
 
-                    avgcc += bestcc;
-                }
-                avgcc /= (nPresses - 1);
-            }
+    auto resOld = std::move(res);
 
-            {
-                std::lock_guard<std::mutex> lock(mutex);
-                ++nFinished;
-                cv.notify_one();
-            }
-        }, iw);
-        worker.detach();
-    }
+    res.clear();
+    res.resize(nPresses);
+    for (auto & x : res) x.resize(nPresses);
 
-    std::unique_lock<std::mutex> lock(mutex);
-    cv.wait(lock, [&]() { return nFinished == nWorkers; });
+    calculateSimilarityMapRows(keyPressWidth_samples, alignWindow_samples, offsetFromPeak_samples, keyPresses, resOld, idxOld, res);
 
     return true;
 }
 
-template bool calculateSimilartyMap<TSampleI16>(
+template bool updateSimilarityMap<TSampleI16>(
         const int32_t keyPressWidth_samples,
         const int32_t alignWindow_samples,
         const int32_t offsetFromPeak_samples,
+        const TKeyPressCollectionT<TSampleI16> & keyPressesOld,
         TKeyPressCollectionT<TSampleI16> & keyPresses,
         TSimilarityMap & res);
 
@@ -1004,6 +1165,85 @@ template bool findKeyPresses<TSampleI16>(
         int historySizeReset,
         bool removeLowPower);
 
+template<typename T>
+bool updateKeyPresses(
+        const TWaveformViewT<T> & waveform,
+        int64_t & offset,
+        TKeyPressCollectionT<T> & res,
+        double thresholdBackground,
+        int historySize,
+        int historySizeReset,
+        bool removeLowPower) {
+    const int k = historySize;
+    const auto samples = waveform.samples;
+    const auto n       = waveform.n;
+
+    if (offset < 0 || offset > n) {
+        return false;
+    }
+
+    // the waveform might have been reallocated since the last call
+    for (auto & kp : res) {
+        kp.waveform = waveform;
+    }
+
+    // findKeyPresses decides the position i based on the samples in [i - 8*k, i + 2*k), so starting the analysis 8*k
+    // samples before offset gives the same raw detections as running it over the whole waveform
+    const int64_t begin = std::max((int64_t) 0, offset - 8*k);
+    const int64_t end   = n - 2*k;
+
+    if (end <= offset) {
+        return true;
+    }
+
+    TKeyPressCollectionT<T> cur;
+    TWaveformT<T> waveformThreshold;
+    TWaveformT<T> waveformMax;
+
+    // no low-power removal and no merging (historySizeReset = 0) - both are done below against the existing key presses
+    if (findKeyPresses(TWaveformViewT<T> { samples + begin, n - begin }, cur, waveformThreshold, waveformMax, thresholdBackground, k, 0, false) == false) {
+        return false;
+    }
+
+    // every detected position is a local max, so its absolute value is also the max in the window around it
+    auto power = [&](const TKeyPressDataT<T> & kp) { return std::abs((double) samples[kp.pos]); };
+
+    for (auto & kp : cur) {
+        kp.waveform = waveform;
+        kp.pos += begin;
+    }
+
+    cur.erase(std::remove_if(cur.begin(), cur.end(), [&](const TKeyPressDataT<T> & kp) { return kp.pos < offset || kp.pos >= end; }), cur.end());
+
+    if (removeLowPower && cur.empty() == false) {
+        double avgPower = 0.0;
+        for (const auto & kp : res) avgPower += power(kp);
+        for (const auto & kp : cur) avgPower += power(kp);
+        avgPower /= res.size() + cur.size();
+
+        cur.erase(std::remove_if(cur.begin(), cur.end(), [&](const TKeyPressDataT<T> & kp) { return power(kp) <= 0.3*avgPower; }), cur.end());
+    }
+
+    for (auto & kp : cur) {
+        if (res.empty() || kp.pos - res.back().pos > historySizeReset || power(kp) > power(res.back())) {
+            res.push_back(std::move(kp));
+        }
+    }
+
+    offset = end;
+
+    return true;
+}
+
+template bool updateKeyPresses<TSampleI16>(
+        const TWaveformViewT<TSampleI16> & waveform,
+        int64_t & offset,
+        TKeyPressCollectionT<TSampleI16> & res,
+        double thresholdBackground,
+        int historySize,
+        int historySizeReset,
+        bool removeLowPower);
+
 template<typename T>
 bool saveKeyPresses(const std::string & fname, const TKeyPressCollectionT<T> & keyPresses) {
     std::ofstream fout(fname, std::ios::binary);
@@ -1188,3 +1428,113 @@ bool adjustKeyPresses(TKeyPressCollectionT<T> & keyPresses, TSimilarityMap & sim
 }
 
 template bool adjustKeyPresses<TSampleI16>(TKeyPressCollectionT<TSampleI16> & keyPresses, TSimilarityMap & sim);
+
+//
+// binary serialization
+//
+
+void writeBytes(std::ostream & out, const void * data, size_t n) {
+    out.write((const char *) data, n);
+}
+
+bool readBytes(std::istream & in, void * data, size_t n) {
+    in.read((char *) data, n);
+    return in.good();
+}
+
+namespace {
+    // make the data of the file (or the entries of a directory) durable
+    bool syncPath(const std::string & path) {
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        const bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+#else
+        (void) path;
+        return true;
+#endif
+    }
+}
+
+bool saveFileAtomic(const std::string & fname, const std::function<bool(std::ostream & out)> & cbWrite) {
+    const std::string fnameTmp = fname + ".tmp";
+
+    {
+        std::ofstream fout(fnameTmp, std::ios::binary);
+        if (fout.good() == false) {
+            printf("    Failed to open file '%s'\n", fnameTmp.c_str());
+            return false;
+        }
+
+        if (cbWrite(fout) == false) {
+            printf("    Failed to write file '%s'\n", fnameTmp.c_str());
+            return false;
+        }
+
+        fout.close();
+        if (fout.fail()) {
+            printf("    Failed to write file '%s'\n", fnameTmp.c_str());
+            return false;
+        }
+    }
+
+    // without this, a crash shortly after the rename can leave an empty or partial file under the final name
+    if (syncPath(fnameTmp) == false) {
+        printf("    Failed to sync file '%s'\n", fnameTmp.c_str());
+        return false;
+    }
+
+    if (std::rename(fnameTmp.c_str(), fname.c_str()) != 0) {
+        printf("    Failed to rename '%s' to '%s'\n", fnameTmp.c_str(), fname.c_str());
+        return false;
+    }
+
+    {
+        const auto pos = fname.find_last_of('/');
+        syncPath(pos == std::string::npos ? "." : (pos == 0 ? "/" : fname.substr(0, pos)));
+    }
+
+    return true;
+}
+
+bool isValidClustering(const TClusters & clusters, const TClusterToLetterMap & clMap, const std::vector<int32_t> & hint, int32_t maxClusters) {
+    if (hint.empty() == false && hint.size() != clusters.size()) return false;
+
+    for (const auto & h : hint) {
+        if (h < -1 || h > 27) return false;
+    }
+    for (const auto & cid : clusters) {
+        if (cid < 0 || cid >= maxClusters) return false;
+    }
+    for (const auto & kv : clMap) {
+        if (kv.first < 0 || kv.first >= maxClusters) return false;
+        if (kv.second < 0 || kv.second > 27) return false;
+    }
+
+    return true;
+}
+
+uint64_t calcHash(const void * data, size_t n, uint64_t h) {
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+
+    return h;
+}
+
+uint64_t calcHash(const TSimilarityMap & similarityMap) {
+    const int32_t n = similarityMap.size();
+    uint64_t h = calcHash(&n, sizeof(n));
+    for (const auto & row : similarityMap) {
+        for (const auto & m : row) {
+            h = calcHash(&m.cc, sizeof(m.cc), h);
+            h = calcHash(&m.offset, sizeof(m.offset), h);
+        }
+    }
+
+    return h;
+}
@@ -6,10 +6,13 @@
 #pragma once
 
 #include <map>
+#include <iosfwd>
 #include <string>
 #include <tuple>
 #include <vector>
 #include <chrono>
+#include <cstdint>
+#include <functional>
 
 // types
 
@@ -35,6 +38,7 @@ using TClusterId    = int32_t;
 
 using TSampleF      = float;
 using TSampleI16    = int16_t;
+using TSampleI32    = int32_t;
 using TSampleMI16   = stSampleMulti<TSampleI16, 4>;
 
 using TKey              = int32_t;
@@ -117,19 +121,71 @@ struct stPlaybackData {
     TWaveformViewT<T> waveform;
 };
 
+// double, so that TSampleI32 input keeps its 32-bit precision through the filter
 struct TFilterCoefficients {
-    float a0 = 0.0f;
-    float a1 = 0.0f;
-    float a2 = 0.0f;
-    float b1 = 0.0f;
-    float b2 = 0.0f;
-    float c0 = 0.0f;
-    float d0 = 0.0f;
-
-    float xnz1 = 0.0f;
-    float xnz2 = 0.0f;
-    float ynz1 = 0.0f;
-    float ynz2 = 0.0f;
+    double a0 = 0.0;
+    double a1 = 0.0;
+    double a2 = 0.0;
+    double b1 = 0.0;
+    double b2 = 0.0;
+    double c0 = 0.0;
+    double d0 = 0.0;
+
+    double xnz1 = 0.0;
+    double xnz2 = 0.0;
+    double ynz1 = 0.0;
+    double ynz2 = 0.0;
+};
+
+// xoshiro256** pseudo-random number generator
+// unlike rand(), each instance has its own state, so it can be used concurrently and the results are reproducible
+struct TRandom {
+    TRandom(uint64_t x = 1) { seed(x); }
+
+    void seed(uint64_t x) {
+        // splitmix64 expansion of the seed
+        for (auto & v : s) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27))*0x94d049bb133111ebull;
+            v = z ^ (z >> 31);
+        }
+    }
+
+    // independent generator for the given stream, e.g. the index of a thread
+    TRandom split(uint64_t stream) const {
+        return TRandom(s[0] ^ s[1] ^ (s[2] << 1) ^ (s[3] << 2) ^ (stream*0xd1b54a32d192ed03ull));
+    }
+
+    inline uint64_t next() {
+        const uint64_t res = rotl(s[1]*5, 7)*9;
+        const uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return res;
+    }
+
+    // uniform in [0, n)
+    inline int32_t uniform(int32_t n) {
+        return (int32_t) (((next() >> 32)*(uint64_t) n) >> 32);
+    }
+
+    // uniform in [0, 1)
+    inline float frand() {
+        return (next() >> 40)*(1.0f/16777216.0f);
+    }
+
+    static inline uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t s[4];
 };
 
 // helpers
@@ -151,6 +207,15 @@ stWaveformView<T> getView(const TWaveformT<T> & waveform, int64_t idx, int64_t l
 
 std::map<std::string, std::string> parseCmdArguments(int argc, char ** argv);
 
+// codebook with nLevels values (sorted) that minimizes the maximum absolute quantization error of the given values
+// maxError is set to the guaranteed bound |value - codebook[quantize(value, codebook)]| <= maxError
+template <typename T>
+std::vector<T> calcQuantizationCodebook(std::vector<T> values, int nLevels, double & maxError);
+
+// index of the codebook entry closest to value
+template <typename T>
+int32_t quantize(T value, const std::vector<T> & codebook);
+
 template <typename T>
 float toSeconds(T t0, T t1) {
     return std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count()/1000.0f;
@@ -159,12 +224,23 @@ float toSeconds(T t0, T t1) {
 template <typename TSampleSrc, typename TSampleDst>
 bool convert(const TWaveformT<TSampleSrc> & src, TWaveformT<TSampleDst> & dst);
 
+// convert the samples starting at offset with a fixed scale instead of normalizing by the absolute max
+// the samples before offset are not touched, so it can be used on a waveform that grows over time (e.g. streamed input)
+// scale = 1.0 maps [-1, 1] to the full range of TSampleDst - values outside of it are clamped
+template <typename TSampleSrc, typename TSampleDst>
+bool convert(const TWaveformT<TSampleSrc> & src, TWaveformT<TSampleDst> & dst, int64_t offset, double scale);
+
 template <typename TSample>
 double calcAbsMax(const TWaveformT<TSample> & waveform);
 
 template <typename TSample>
 void filter(TWaveformT<TSample> & waveform, EAudioFilter filter, float freqCutoff_Hz, int64_t sampleRate);
 
+// filter the samples starting at offset, continuing from the filter state stored in coefficients
+// used to filter a waveform that grows over time (e.g. streamed input)
+template <typename TSample>
+void filter(TWaveformT<TSample> & waveform, int64_t offset, EAudioFilter filter, TFilterCoefficients & coefficients);
+
 template <typename TSample>
 bool saveToFile(const std::string & fname, TWaveformT<TSample> & waveform);
 
@@ -174,6 +250,12 @@ bool readFromFile(const std::string & fname, TWaveformT<TSample> & res);
 template <typename TSampleInput, typename TSample>
 bool readFromFile(const std::string & fname, TWaveformT<TSample> & res, TTrainKeys & trainKeys, int32_t & bufferSize_frames);
 
+// read up to nSamples raw samples from a stream (file, FIFO or stdin) and append them to res
+// blocks until nSamples are available or the stream ends
+// returns the number of samples read - 0 means that there is no more input
+template <typename TSampleInput>
+int64_t readFromStream(std::istream & fin, TWaveformF & res, int64_t nSamples);
+
 //
 // filters
 //
@@ -182,10 +264,19 @@ TFilterCoefficients calculateCoefficientsFirstOrderHighPass(int fc, int fs);
 
 TFilterCoefficients calculateCoefficientsSecondOrderButterworthHighPass(int fc, int fs);
 
+TFilterCoefficients calculateCoefficients(EAudioFilter filter, int fc, int fs);
+
 TSampleF filterFirstOrderHighPass(TFilterCoefficients & coefficients, TSampleF sample);
 
 TSampleF filterSecondOrderButterworthHighPass(TFilterCoefficients & coefficients, TSampleF sample);
 
+// integer samples (TSampleI16, TSampleI32) are filtered in double and the result is rounded and clamped to their range
+template <typename TSample>
+TSample filterFirstOrderHighPass(TFilterCoefficients & coefficients, TSample sample);
+
+template <typename TSample>
+TSample filterSecondOrderButterworthHighPass(TFilterCoefficients & coefficients, TSample sample);
+
 //
 // calcSum
 //
@@ -239,6 +330,18 @@ bool calculateSimilartyMap(
         TKeyPressCollectionT<T> & keyPresses,
         TSimilarityMap & res);
 
+// same as calculateSimilartyMap, but reuses the entries of res that were computed for keyPressesOld
+// only pairs involving key presses at positions not present in keyPressesOld are evaluated
+// the waveform around the old positions must not have changed (e.g. a stream that only grows)
+template<typename T>
+bool updateSimilarityMap(
+        const int32_t keyPressWidth_samples,
+        const int32_t alignWindow_samples,
+        const int32_t offsetFromPeak_samples,
+        const TKeyPressCollectionT<T> & keyPressesOld,
+        TKeyPressCollectionT<T> & keyPresses,
+        TSimilarityMap & res);
+
 //
 // findKeyPresses
 //
@@ -254,6 +357,21 @@ bool findKeyPresses(
         int historySizeReset,
         bool removeLowPower);
 
+// same as findKeyPresses, but for a waveform that only grows (e.g. streamed input)
+// the key presses before offset are final and are kept as they are - only the samples in [offset - 8*historySize, n)
+// are analyzed and the newly detected key presses are appended to res
+// low-power presses are rejected against the average power of all presses so far
+// on return, offset is the position up to which the detection is final
+template<typename T>
+bool updateKeyPresses(
+        const TWaveformViewT<T> & waveform,
+        int64_t & offset,
+        TKeyPressCollectionT<T> & res,
+        double thresholdBackground,
+        int historySize,
+        int historySizeReset,
+        bool removeLowPower);
+
 template<typename T>
 bool saveKeyPresses(const std::string & fname, const TKeyPressCollectionT<T> & keyPresses);
 
@@ -276,3 +394,50 @@ bool generateLowResWaveform(const TWaveformT<T> & waveform, TWaveformT<T> & wave
 
 template<typename T>
 bool adjustKeyPresses(TKeyPressCollectionT<T> & keyPresses, TSimilarityMap & sim);
+
+//
+// binary serialization - raw values in native byte order
+//
+
+void writeBytes(std::ostream & out, const void * data, size_t n);
+bool readBytes(std::istream & in, void * data, size_t n);
+
+template <typename T>
+void writeValue(std::ostream & out, const T & v) {
+    writeBytes(out, &v, sizeof(v));
+}
+
+template <typename T>
+bool readValue(std::istream & in, T & v) {
+    return readBytes(in, &v, sizeof(v));
+}
+
+template <typename T>
+void writeVector(std::ostream & out, const std::vector<T> & v) {
+    const int32_t n = v.size();
+    writeValue(out, n);
+    writeBytes(out, v.data(), n*sizeof(T));
+}
+
+// fails for stored sizes above nMax, so that a corrupted file cannot cause a huge allocation
+template <typename T>
+bool readVector(std::istream & in, std::vector<T> & v, int32_t nMax) {
+    int32_t n = 0;
+    if (readValue(in, n) == false || n < 0 || n > nMax) return false;
+    v.resize(n);
+    return readBytes(in, v.data(), n*sizeof(T));
+}
+
+// write fname through a temporary file that is flushed to disk and then renamed over it
+// an interrupted write leaves the previous contents of fname intact
+bool saveFileAtomic(const std::string & fname, const std::function<bool(std::ostream & out)> & cbWrite);
+
+// 64-bit FNV-1a
+uint64_t calcHash(const void * data, size_t n, uint64_t h = 0xcbf29ce484222325ull);
+
+// check a clustering read from a file - cluster ids in [0, maxClusters), letters in [0, 27]
+// the hint is either empty or has a letter (or -1 for none) for each element of clusters
+bool isValidClustering(const TClusters & clusters, const TClusterToLetterMap & clMap, const std::vector<int32_t> & hint, int32_t maxClusters);
+
+// hash of the cc values and offsets - used to check that a saved state belongs to the same similarity map
+uint64_t calcHash(const TSimilarityMap & similarityMap);
@@ -1,20 +1,45 @@
 #include "subbreak3.h"
 
 int main(int argc, char ** argv) {
-    printf("Usage: %s n-gram.dat n-gram-compressed.dat\n", argv[0]);
+    printf("Usage: %s n-gram.dat n-gram-compressed.dat [-vN] [-tN] [-mN]\n", argv[0]);
+    printf("    -vN - output format, (1 - delta-compressed, 3 - mmap-able lookup table and Bloom filter; 2 is the same as 3)\n");
+    printf("    -tN - number of threads for the wildcard expansion (default - all cores)\n");
+    printf("    -mN - memory budget in MB for the wildcard expansion, the rest is spilled to disk (default - no limit)\n");
+    printf("    The input can also be a previously compressed '.binary' file\n");
     if (argc < 3) {
         return -1;
     }
 
+    const auto argm = parseCmdArguments(argc, argv);
+    const int version = argm.count("v") == 0 ? 1 : std::stoi(argm.at("v"));
+    const int nThreads = argm.count("t") == 0 ? -1 : std::stoi(argm.at("t"));
+    const int64_t memoryBudget_MB = argm.count("m") == 0 ? -1 : std::stoll(argm.at("m"));
+
     Cipher::TFreqMap freqMap;
 
-    printf("[+] Reading n-grams from '%s'\n", argv[1]);
-    if (Cipher::loadFreqMap(argv[1], freqMap) == false) {
-        return -1;
+    const std::string fnameIn = argv[1];
+    if (fnameIn.size() > 7 && fnameIn.substr(fnameIn.size() - 7) == ".binary") {
+        printf("[+] Reading compressed n-grams from '%s'\n", argv[1]);
+        if (Cipher::loadFreqMapBinary(argv[1], freqMap) == false) {
+            return -1;
+        }
+    } else {
+        printf("[+] Reading n-grams from '%s'\n", argv[1]);
+        if (Cipher::loadFreqMap(argv[1], freqMap, 0.000001, nThreads, memoryBudget_MB) == false) {
+            return -1;
+        }
     }
 
-    printf("[+] Writing compressed n-grams to '%s'\n", argv[2]);
-    Cipher::saveFreqMapBinary(argv[2], freqMap);
+    printf("[+] Writing compressed n-grams to '%s' (v%d)\n", argv[2], version >= 2 ? 3 : 1);
+    if (version >= 2) {
+        if (Cipher::saveFreqMapBinaryV3(argv[2], freqMap) == false) {
+            return -1;
+        }
+    } else {
+        if (Cipher::saveFreqMapBinary(argv[2], freqMap) == false) {
+            return -1;
+        }
+    }
 
     return 0;
 }
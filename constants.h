@@ -45,6 +45,9 @@ static constexpr int64_t kKeyDuration_samples = 0.005f*kSampleRate;
 
 static constexpr float kFreqCutoff_Hz = 100.0f;
 
+// time between the checkpoints of the long-running searches (see -k in keytap2-gui / keytap3-gui)
+static constexpr float kCheckpointInterval_s = 60.0f;
+
 static std::map<char, std::vector<char>> kNearbyKeys = {
     { 'a', { 'a', 'q', 'w', 's', 'z', 'x',                               } },
     { 'b', { 'b', 'f', 'g', 'h', 'v', 'n',                               } },
@@ -13,11 +13,14 @@
 #include <chrono>
 #include <thread>
 #include <fstream>
+#include <iostream>
 
 int main(int argc, char ** argv) {
-    printf("Usage: %s output.kbd nkeys [-cN] [-CN]\n", argv[0]);
+    printf("Usage: %s output.kbd nkeys [-cN] [-CN] [-s] [-tN]\n", argv[0]);
     printf("    -cN - select capture device N\n");
     printf("    -CN - number N of capture channels N\n");
+    printf("    -s  - read raw PCM from stdin instead of a capture device\n");
+    printf("    -tN - sample type of the stdin input, (0 - f32, 1 - i16)\n");
     printf("\n");
 
     if (argc < 3) {
@@ -27,6 +30,8 @@ int main(int argc, char ** argv) {
     const auto argm = parseCmdArguments(argc, argv);
     const int captureId = argm.count("c") == 0 ? 0 : std::stoi(argm.at("c"));
     const int nChannels = argm.count("C") == 0 ? 0 : std::stoi(argm.at("C"));
+    const bool streamInput = argm.count("s") > 0;
+    const int sampleTypeId = argm.count("t") == 0 ? 0 : std::stoi(argm.at("t"));
 
     const int nKeysToCapture = atoi(argv[2]);
 
@@ -36,29 +41,27 @@ int main(int argc, char ** argv) {
     size_t totalSize_bytes = 0;
 
     TWaveformF waveformF;
+    TWaveformF waveformFFiltered;
     TWaveformI16 waveformI16;
     TKeyPressCollectionT<TSampleI16> keyPresses;
 
-    AudioLogger audioLogger;
+    // apply default filtering, because keypress detection without it is impossible
+    auto filterCoefficients = calculateCoefficients(EAudioFilter::FirstOrderHighPass, kFreqCutoff_Hz, kSampleRate);
+    int64_t offsetDetected = 0;
 
-    AudioLogger::Callback cbAudio = [&](const auto & frames) {
-        for (auto & frame : frames) {
-            waveformF.insert(waveformF.end(), frame.begin(), frame.end());
-        }
+    AudioLogger audioLogger;
 
-        {
-            // apply default filtering, because keypress detection without it is impossible
-            auto waveformFFiltered = waveformF;
-            ::filter(waveformFFiltered, EAudioFilter::FirstOrderHighPass, kFreqCutoff_Hz, kSampleRate);
+    // only the samples added since the last call are filtered and converted
+    auto detectKeyPresses = [&]() {
+        const int64_t offset = waveformFFiltered.size();
+        waveformFFiltered.insert(waveformFFiltered.end(), waveformF.begin() + offset, waveformF.end());
+        ::filter(waveformFFiltered, offset, EAudioFilter::FirstOrderHighPass, filterCoefficients);
 
-            if (convert(waveformFFiltered, waveformI16) == false) {
-                printf("Conversion failed\n");
-            }
+        if (convert(waveformFFiltered, waveformI16, offset, 1.0) == false) {
+            printf("Conversion failed\n");
         }
 
-        TWaveformI16 waveformMax;
-        TWaveformI16 waveformThreshold;
-        if (findKeyPresses(getView(waveformI16, 0), keyPresses, waveformThreshold, waveformMax, 8.0, 512, 2*1024, true) == false) {
+        if (updateKeyPresses(getView(waveformI16, 0), offsetDetected, keyPresses, 8.0, 512, 2*1024, true) == false) {
             printf("Failed to detect keypresses\n");
         }
 
@@ -74,28 +77,51 @@ int main(int argc, char ** argv) {
         }
     };
 
-    AudioLogger::Parameters parameters;
-    parameters.callback = std::move(cbAudio);
-    parameters.captureId = captureId;
-    parameters.nChannels = nChannels;
-    parameters.sampleRate = kSampleRate;
-    parameters.filter = EAudioFilter::None;
-    //parameters.freqCutoff_Hz = kFreqCutoff_Hz;
+    if (streamInput) {
+        while (doneRecording == false) {
+            const int64_t nRead = sampleTypeId == 0 ?
+                readFromStream<TSampleF>  (std::cin, waveformF, kSamplesPerFrame*getBufferSize_frames(kSampleRate, 0.5f)) :
+                readFromStream<TSampleI16>(std::cin, waveformF, kSamplesPerFrame*getBufferSize_frames(kSampleRate, 0.5f));
 
-    if (audioLogger.install(std::move(parameters)) == false) {
-        fprintf(stderr, "Failed to install audio logger\n");
-        return -1;
-    }
+            if (nRead == 0) {
+                printf("Input ended after detecting %d keys\n", nKeysHave);
+                break;
+            }
 
-    while (true) {
-        if (doRecord) {
-            doRecord = false;
-            audioLogger.record(0.5f, 0);
-        } else {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            detectKeyPresses();
         }
+    } else {
+        AudioLogger::Callback cbAudio = [&](const auto & frames) {
+            for (auto & frame : frames) {
+                waveformF.insert(waveformF.end(), frame.begin(), frame.end());
+            }
+
+            detectKeyPresses();
+        };
+
+        AudioLogger::Parameters parameters;
+        parameters.callback = std::move(cbAudio);
+        parameters.captureId = captureId;
+        parameters.nChannels = nChannels;
+        parameters.sampleRate = kSampleRate;
+        parameters.filter = EAudioFilter::None;
+        //parameters.freqCutoff_Hz = kFreqCutoff_Hz;
+
+        if (audioLogger.install(std::move(parameters)) == false) {
+            fprintf(stderr, "Failed to install audio logger\n");
+            return -1;
+        }
+
+        while (true) {
+            if (doRecord) {
+                doRecord = false;
+                audioLogger.record(0.5f, 0);
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
 
-        if (doneRecording) break;
+            if (doneRecording) break;
+        }
     }
 
     printf("\n\n Done recording\n");
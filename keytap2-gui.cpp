@@ -213,6 +213,11 @@ struct stStateCore {
     TKeyPressCollection keyPresses;
 
     std::map<int, Cipher::Processor> processors;
+
+    // resumed after the first initialization of the processors and saved every kCheckpointInterval_s
+    std::string fnameCheckpoint;
+    bool resumeCheckpoint = false;
+    std::chrono::steady_clock::time_point tLastCheckpoint = std::chrono::steady_clock::now();
 };
 
 struct stStateCapture {
@@ -1245,12 +1250,14 @@ int main(int argc, char ** argv) {
     srand(time(0));
 
     printf("Build: %s, (%s)\n", kGIT_DATE, kGIT_SHA1);
-    printf("Usage: %s record.kbd n-gram-dir [-pN] [-cN] [-CN] [-FN] [-fN]\n", argv[0]);
+    printf("Usage: %s record.kbd n-gram-dir [-pN] [-cN] [-CN] [-FN] [-fN] [-qN] [-kFNAME]\n", argv[0]);
     printf("    -pN - select playback device N\n");
     printf("    -cN - select capture device N\n");
     printf("    -CN - select number N of capture channels to use\n");
     printf("    -FN - select filter type, (0 - none, 1 - first order high-pass, 2 - second order high-pass)\n");
     printf("    -fN - cutoff frequency in Hz\n");
+    printf("    -qN - quantize the n-gram probabilities to N bits (8 or 16) to reduce memory usage\n");
+    printf("    -kFNAME - resume the search from checkpoint FNAME, if it exists, and update it periodically\n");
 
     if (argc < 3) {
         return -1;
@@ -1262,11 +1269,16 @@ int main(int argc, char ** argv) {
     const int nChannels     = argm.count("C") == 0 ? 0 : std::stoi(argm.at("C"));
     const int filterId      = argm.count("F") == 0 ? EAudioFilter::FirstOrderHighPass : std::stoi(argm.at("F"));
     const int freqCutoff_Hz = argm.count("f") == 0 ? kFreqCutoff_Hz : std::stoi(argm.at("f"));
+    const int nQuantBits    = argm.count("q") == 0 ? 0 : std::stoi(argm.at("q"));
+    const std::string fnameCheckpoint = argm.count("k") == 0 ? "" : argm.at("k");
 
     stateUI.params.playbackId = playbackId;
     stateUI.fnameRecord = argv[1];
     stateUI.fnameKeyPressess = stateUI.fnameRecord + ".keys";
 
+    stateCore.fnameCheckpoint = fnameCheckpoint;
+    stateCore.resumeCheckpoint = fnameCheckpoint.empty() == false;
+
     stateUI.waveformInput.reserve(kSamplesPerFrame*kMaxRecordSize_frames);
     stateUI.waveformOriginal.reserve(kSamplesPerFrame*kMaxRecordSize_frames);
 
@@ -1356,6 +1368,13 @@ int main(int argc, char ** argv) {
     if (Cipher::loadFreqMap((std::string(argv[2]) + "/./english_quintgrams.txt").c_str(), freqMap5) == false) {
         return -5;
     }
+    if (nQuantBits > 0) {
+        for (auto freqMap : { &freqMap3, &freqMap4, &freqMap5 }) {
+            if (Cipher::quantizeFreqMap(*freqMap, nQuantBits) == false) {
+                return -5;
+            }
+        }
+    }
     stateCore.freqMap[0] = &freqMap3;
     stateCore.freqMap[1] = &freqMap4;
     stateCore.freqMap[2] = &freqMap5;
@@ -1714,6 +1733,7 @@ int main(int argc, char ** argv) {
 
                         Cipher::TParameters params;
                         params.maxClusters = nClusters;
+                        params.rng.seed(rand());
                         stateCore.processors[i] = Cipher::Processor();
                         stateCore.processors[i].init(
                                 params,
@@ -1725,6 +1745,13 @@ int main(int argc, char ** argv) {
 
                         printf("[+] Processor %d initialized: cluster = %d, p = %g, w = %g\n", i, nClusters, p, w);
                     }
+
+                    if (stateCore.resumeCheckpoint) {
+                        stateCore.resumeCheckpoint = false;
+                        if (Cipher::loadProcessors(stateCore.fnameCheckpoint.c_str(), stateCore.processors)) {
+                            printf("[+] Resumed the processors from checkpoint '%s'\n", stateCore.fnameCheckpoint.c_str());
+                        }
+                    }
                 }
 
                 if (stateUINew.flags.changeProcessing) {
@@ -1742,6 +1769,7 @@ int main(int argc, char ** argv) {
 
                         Cipher::TParameters params;
                         params.maxClusters = nClusters;
+                        params.rng.seed(rand());
                         stateCore.processors[i].init(
                                 params,
                                 *stateCore.freqMap[i%3],
@@ -1820,6 +1848,14 @@ int main(int argc, char ** argv) {
                 std::unique_lock<std::mutex> lock(mutex);
                 cv.wait(lock, [&]() { return nFinished == nWorkers; });
 #endif
+
+                if (stateCore.fnameCheckpoint.empty() == false) {
+                    const auto tNow = std::chrono::steady_clock::now();
+                    if (std::chrono::duration<float>(tNow - stateCore.tLastCheckpoint).count() > kCheckpointInterval_s) {
+                        Cipher::saveProcessors(stateCore.fnameCheckpoint.c_str(), stateCore.processors);
+                        stateCore.tLastCheckpoint = tNow;
+                    }
+                }
             } else {
                 std::this_thread::sleep_for(std::chrono::milliseconds(1));
             }
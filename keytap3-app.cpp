@@ -173,6 +173,8 @@ struct StateRecording {
 
 struct StateDecoding {
     std::string pathData = "./data";
+    bool sharedModel = false;
+    int nReplicas = 1;
     TWaveform waveformInput;
     Cipher::TFreqMap freqMap6;
 };
@@ -294,7 +296,11 @@ bool AppInterface::init(State & state) {
                             const auto filename = state.decoding.pathData + "/./ggwords-6-gram.dat.binary";
                             printf("[+] Loading n-grams from '%s'\n", filename.c_str());
 
-                            if (Cipher::loadFreqMapBinary(filename.c_str(), state.decoding.freqMap6) == false) {
+                            const bool res = state.decoding.sharedModel ?
+                                Cipher::loadFreqMapShared(filename.c_str(), state.decoding.freqMap6) :
+                                Cipher::loadFreqMapBinary(filename.c_str(), state.decoding.freqMap6);
+
+                            if (res == false) {
                                 printf("[E] Failed to load n-grams\n");
                                 return;
                             }
@@ -423,36 +429,25 @@ bool AppInterface::init(State & state) {
                                 printf("[+] Similarity map: min = %g, max = %g\n", minCC, maxCC);
                             }
                             {
-                                Cipher::Processor processor;
-
                                 Cipher::TParameters params;
                                 params.maxClusters = 29;
                                 params.wEnglishFreq = 20.0;
                                 params.nHypothesesToKeep = std::max(100, 2100 - 10*std::min(200, std::max(0, ((int) keyPresses.size() - 100))));
-                                processor.init(params, state.decoding.freqMap6, similarityMap);
+#ifdef __EMSCRIPTEN__
+                                // stay well within PTHREAD_POOL_SIZE
+                                params.nThreads = std::min(4, std::max(1, (int) std::thread::hardware_concurrency()));
+#else
+                                params.nThreads = std::max(1, (int) std::thread::hardware_concurrency());
+#endif
 
                                 printf("[+] Attempting to recover the text from the recording. nHypothesesToKeep = %d\n", params.nHypothesesToKeep);
 
                                 std::vector<Cipher::TResult> clusterings;
 
-                                // clustering
-                                {
-                                    const auto tStart = std::chrono::high_resolution_clock::now();
-
-                                    for (int nIter = 0; nIter < 16; ++nIter) {
-                                        auto clusteringsCur = processor.getClusterings(params, 32);
-
-                                        for (int i = 0; i < (int) clusteringsCur.size(); ++i) {
-                                            printf("[+] Clustering %d: pClusters = %g\n", i, clusteringsCur[i].pClusters);
-                                            clusterings.push_back(std::move(clusteringsCur[i]));
-                                        }
-
-                                        params.maxClusters = 29 + 4*(nIter + 1);
-                                        processor.init(params, state.decoding.freqMap6, similarityMap);
-                                    }
-
-                                    const auto tEnd = std::chrono::high_resolution_clock::now();
-                                    printf("[+] Clustering took %4.3f seconds\n", toSeconds(tStart, tEnd));
+                                // one simulated annealing chain per maxClusters value
+                                std::vector<int> maxClusters;
+                                for (int nIter = 0; nIter < 16; ++nIter) {
+                                    maxClusters.push_back(29 + 4*nIter);
                                 }
 
                                 params.hint.clear();
@@ -460,14 +455,17 @@ bool AppInterface::init(State & state) {
 
                                 [[maybe_unused]] int nConverged = 0;
                                 while (true) {
-                                    // beam search
+                                    // clustering + beam search
                                     {
-                                        for (int i = 0; i < (int) clusterings.size(); ++i) {
-                                            Cipher::beamSearch(params, state.decoding.freqMap6, clusterings[i]);
-                                            printf("%8.3f %8.3f ", clusterings[i].p, clusterings[i].pClusters);
-                                            Cipher::printDecoded(clusterings[i].clusters, clusterings[i].clMap, params.hint);
-                                            Cipher::refineNearby(params, state.decoding.freqMap6, clusterings[i]);
-                                        }
+                                        const auto tStart = std::chrono::high_resolution_clock::now();
+
+                                        clusterings.clear();
+
+                                        Cipher::decodePipelined(params, state.decoding.freqMap6, similarityMap, maxClusters, 32, state.decoding.nReplicas, 2*params.nThreads,
+                                                                Cipher::getPrintDecodedCallback(params.hint, clusterings));
+
+                                        const auto tEnd = std::chrono::high_resolution_clock::now();
+                                        printf("[+] Decoding %d clusterings took %4.3f seconds\n", (int) clusterings.size(), toSeconds(tStart, tEnd));
                                     }
 
                                     break;
@@ -500,11 +498,13 @@ bool AppInterface::init(State & state) {
 
 int main(int argc, char ** argv) {
     printf("Build info: %s, %s, %s\n", kGIT_DATE, kGIT_SHA1, kGIT_COMMIT_SUBJECT);
-    printf("Usage: %s record.kbd n-gram-dir nkeys [-cN] [-CN] [-FN] [-fN]\n", argv[0]);
+    printf("Usage: %s record.kbd n-gram-dir nkeys [-cN] [-CN] [-FN] [-fN] [-S] [-rN]\n", argv[0]);
     printf("    -cN - select capture device N\n");
     printf("    -CN - number N of capture channels N\n");
     printf("    -FN - select filter type, (0 - none, 1 - first order high-pass, 2 - second order high-pass)\n");
     printf("    -fN - cutoff frequency in Hz\n");
+    printf("    -S  - share the n-gram model with other processes through shared memory\n");
+    printf("    -rN - number of parallel tempering replicas per clustering chain\n");
 
     if (argc < 4) {
         return -1;
@@ -515,6 +515,8 @@ int main(int argc, char ** argv) {
     const int nChannels     = argm.count("C") == 0 ? 0 : std::stoi(argm.at("C"));
     const int filterId      = argm.count("F") == 0 ? EAudioFilter::FirstOrderHighPass : std::stoi(argm.at("F"));
     const int freqCutoff_Hz = argm.count("f") == 0 ? kFreqCutoff_Hz : std::stoi(argm.at("f"));
+    const bool sharedModel  = argm.count("S") > 0;
+    const int nReplicas     = argm.count("r") == 0 ? 1 : std::stoi(argm.at("r"));
 
     const int nKeysToCapture = atoi(argv[3]);
 
@@ -528,6 +530,8 @@ int main(int argc, char ** argv) {
     state.recording.pathOutput = argv[1];
 
     state.decoding.pathData = argv[2];
+    state.decoding.sharedModel = sharedModel;
+    state.decoding.nReplicas = nReplicas;
 
     // initialize the application interface
     if (g_appInterface.init(state) == false) {
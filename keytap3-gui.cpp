@@ -202,6 +202,11 @@ struct stStateCore {
     TKeyPressCollection keyPresses;
 
     std::map<int, Cipher::Processor> processors;
+
+    // resumed after the first initialization of the processors and saved every kCheckpointInterval_s
+    std::string fnameCheckpoint;
+    bool resumeCheckpoint = false;
+    std::chrono::steady_clock::time_point tLastCheckpoint = std::chrono::steady_clock::now();
 };
 
 struct stStateCapture {
@@ -1227,12 +1232,13 @@ int main(int argc, char ** argv) {
     srand(time(0));
 
     printf("Build: %s, (%s)\n", kGIT_DATE, kGIT_SHA1);
-    printf("Usage: %s record.kbd n-gram-dir [-pN] [-cN] [-CN] [-FN] [-fN]\n", argv[0]);
+    printf("Usage: %s record.kbd n-gram-dir [-pN] [-cN] [-CN] [-FN] [-fN] [-kFNAME]\n", argv[0]);
     printf("    -pN - select playback device N\n");
     printf("    -cN - select capture device N\n");
     printf("    -CN - select number N of capture channels to use\n");
     printf("    -FN - select filter type, (0 - none, 1 - first order high-pass, 2 - second order high-pass)\n");
     printf("    -fN - cutoff frequency in Hz\n");
+    printf("    -kFNAME - resume the search from checkpoint FNAME, if it exists, and update it periodically\n");
 
     if (argc < 3) {
         return -1;
@@ -1244,11 +1250,15 @@ int main(int argc, char ** argv) {
     const int nChannels     = argm.count("C") == 0 ? 0 : std::stoi(argm.at("C"));
     const int filterId      = argm.count("F") == 0 ? EAudioFilter::FirstOrderHighPass : std::stoi(argm.at("F"));
     const int freqCutoff_Hz = argm.count("f") == 0 ? kFreqCutoff_Hz : std::stoi(argm.at("f"));
+    const std::string fnameCheckpoint = argm.count("k") == 0 ? "" : argm.at("k");
 
     stateUI.params.playbackId = playbackId;
     stateUI.fnameRecord = argv[1];
     stateUI.fnameKeyPressess = stateUI.fnameRecord + ".keys";
 
+    stateCore.fnameCheckpoint = fnameCheckpoint;
+    stateCore.resumeCheckpoint = fnameCheckpoint.empty() == false;
+
     stateUI.waveformInput.reserve(kSamplesPerFrame*kMaxRecordSize_frames);
     stateUI.waveformOriginal.reserve(kSamplesPerFrame*kMaxRecordSize_frames);
 
@@ -1713,6 +1723,7 @@ int main(int argc, char ** argv) {
 
                         Cipher::TParameters params;
                         params.maxClusters = nClusters;
+                        params.rng.seed(rand());
                         params.wEnglishFreq = w;
                         stateCore.processors[i] = Cipher::Processor();
                         stateCore.processors[i].init(
@@ -1722,6 +1733,13 @@ int main(int argc, char ** argv) {
 
                         printf("[+] Processor %d initialized: cluster = %d, w = %g\n", i, nClusters, w);
                     }
+
+                    if (stateCore.resumeCheckpoint) {
+                        stateCore.resumeCheckpoint = false;
+                        if (Cipher::loadProcessors(stateCore.fnameCheckpoint.c_str(), stateCore.processors)) {
+                            printf("[+] Resumed the processors from checkpoint '%s'\n", stateCore.fnameCheckpoint.c_str());
+                        }
+                    }
                 }
 
                 if (stateUINew.flags.changeProcessing) {
@@ -1738,6 +1756,7 @@ int main(int argc, char ** argv) {
 
                         Cipher::TParameters params;
                         params.maxClusters = nClusters;
+                        params.rng.seed(rand());
                         params.wEnglishFreq = w;
                         stateCore.processors[i].init(
                                 params,
@@ -1804,6 +1823,14 @@ int main(int argc, char ** argv) {
                 std::unique_lock<std::mutex> lock(mutex);
                 cv.wait(lock, [&]() { return nFinished == nWorkers; });
 #endif
+
+                if (stateCore.fnameCheckpoint.empty() == false) {
+                    const auto tNow = std::chrono::steady_clock::now();
+                    if (std::chrono::duration<float>(tNow - stateCore.tLastCheckpoint).count() > kCheckpointInterval_s) {
+                        Cipher::saveProcessors(stateCore.fnameCheckpoint.c_str(), stateCore.processors);
+                        stateCore.tLastCheckpoint = tNow;
+                    }
+                }
             } else {
                 std::this_thread::sleep_for(std::chrono::milliseconds(1));
             }
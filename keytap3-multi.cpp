@@ -151,6 +151,7 @@ int main(int argc, char ** argv) {
         params.nIters = 1;
         params.nInitialIters = 0;
         params.wEnglishFreq = 10.0f;
+        params.rng.seed(time(0));
         processor.init(params, freqMap6, similarityMap);
 
         double lastP = -1000.0;
@@ -188,6 +189,7 @@ int main(int argc, char ** argv) {
             params.maxClusters = 40 + rand()%50;
             params.nInitialIters = 100 + rand()%5000;
             params.wEnglishFreq = 2.0f + rand()%50;
+            params.rng.seed(rand());
             processor.init(params, freqMap6, similarityMap);
         }
     }
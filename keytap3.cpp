@@ -10,9 +10,11 @@
 #include <chrono>
 #include <cstdio>
 #include <fstream>
+#include <iostream>
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <thread>
 
 #define MY_DEBUG
 
@@ -24,9 +26,15 @@ using TKeyPressData         = TKeyPressDataI16;
 using TKeyPressCollection   = TKeyPressCollectionI16;
 
 int main(int argc, char ** argv) {
-    printf("Usage: %s record.kbd n-gram-dir [-FN] [-fN]\n", argv[0]);
+    printf("Usage: %s record.kbd n-gram-dir [-FN] [-fN] [-s] [-tN] [-qN] [-S] [-U] [-rN]\n", argv[0]);
     printf("    -FN - select filter type, (0 - none, 1 - first order high-pass, 2 - second order high-pass)\n");
     printf("    -fN - cutoff frequency in Hz\n");
+    printf("    -s  - stream raw PCM from record.kbd while it is being written (FIFO, or '-' for stdin)\n");
+    printf("    -tN - sample type of the streamed input, (0 - f32, 1 - i16)\n");
+    printf("    -qN - quantize the n-gram probabilities to N bits (8 or 16) to reduce memory usage\n");
+    printf("    -S  - share the n-gram model with other processes through shared memory (cannot be combined with -q)\n");
+    printf("    -U  - remove the shared memory copies of the n-gram model and exit\n");
+    printf("    -rN - number of parallel tempering replicas per clustering chain\n");
     if (argc < 3) {
         return -1;
     }
@@ -36,9 +44,105 @@ int main(int argc, char ** argv) {
     const auto argm = parseCmdArguments(argc, argv);
     const int filterId      = argm.count("F") == 0 ? EAudioFilter::FirstOrderHighPass : std::stoi(argm.at("F"));
     const int freqCutoff_Hz = argm.count("f") == 0 ? kFreqCutoff_Hz : std::stoi(argm.at("f"));
+    const bool streamInput  = argm.count("s") > 0;
+    const int sampleTypeId  = argm.count("t") == 0 ? 0 : std::stoi(argm.at("t"));
+    const int nQuantBits    = argm.count("q") == 0 ? 0 : std::stoi(argm.at("q"));
+    const bool sharedModel  = argm.count("S") > 0;
+    const bool unlinkModel  = argm.count("U") > 0;
+    const int nReplicas     = argm.count("r") == 0 ? 1 : std::stoi(argm.at("r"));
 
-    TWaveform waveformInput;
+    const auto fnameModel = std::string(argv[2]) + "/ggwords-6-gram.dat.binary";
+
+    if (unlinkModel) {
+        return Cipher::unlinkFreqMapShared(fnameModel.c_str()) ? 0 : -5;
+    }
+
+    if (sharedModel && nQuantBits > 0) {
+        printf("The shared n-gram model cannot be quantized - use either -S or -q\n");
+        return -1;
+    }
+
+    // load the language model first, so that a streamed recording can be decoded as soon as it ends
+    Cipher::TFreqMap freqMap6;
     {
+        const auto tStart = std::chrono::high_resolution_clock::now();
+
+        printf("[+] Loading n-grams from '%s'\n", argv[2]);
+
+        if ((sharedModel ? Cipher::loadFreqMapShared(fnameModel.c_str(), freqMap6) : Cipher::loadFreqMapBinary(fnameModel.c_str(), freqMap6)) == false) {
+            return -5;
+        }
+
+        if (nQuantBits > 0 && Cipher::quantizeFreqTable(freqMap6, nQuantBits) == false) {
+            return -5;
+        }
+
+        const auto tEnd = std::chrono::high_resolution_clock::now();
+
+        printf("[+] Loading took %4.3f seconds\n", toSeconds(tStart, tEnd));
+    }
+
+    TWaveform waveformInput;
+    TKeyPressCollection keyPresses;
+    TSimilarityMap similarityMap;
+
+    if (streamInput) {
+        // detection and the similarity map are updated after each chunk, so when the stream ends
+        // only the key presses from the last chunk remain to be processed
+        std::ifstream finFile;
+        if (std::string(argv[1]) != "-") {
+            finFile.open(argv[1], std::ios::binary);
+            if (finFile.good() == false) {
+                printf("Specified file '%s' does not exist\n", argv[1]);
+                return -1;
+            }
+        }
+        std::istream & fin = finFile.is_open() ? finFile : std::cin;
+
+        printf("[+] Streaming recording from '%s' (sample type = %s)\n", argv[1], sampleTypeId == 0 ? "f32" : "i16");
+        printf("[+] Filtering waveform with filter type = %d and cutoff frequency = %d Hz\n", filterId, freqCutoff_Hz);
+
+        const auto tStart = std::chrono::high_resolution_clock::now();
+
+        TWaveformF waveformInputF;
+        int64_t offsetDetected = 0;
+
+        auto filterCoefficients = calculateCoefficients((EAudioFilter) filterId, freqCutoff_Hz, kSampleRate);
+
+        while (true) {
+            const int64_t offset = waveformInputF.size();
+            const int64_t nRead = sampleTypeId == 0 ?
+                readFromStream<TSampleF>  (fin, waveformInputF, kSampleRate) :
+                readFromStream<TSampleI16>(fin, waveformInputF, kSampleRate);
+
+            if (nRead == 0) break;
+
+            ::filter(waveformInputF, offset, (EAudioFilter) filterId, filterCoefficients);
+
+            // fixed scale, so that the already converted samples and the key presses in them do not change
+            if (convert(waveformInputF, waveformInput, offset, 1.0) == false) {
+                printf("Conversion failed\n");
+                return -4;
+            }
+
+            const auto keyPressesOld = keyPresses;
+            if (updateKeyPresses(getView(waveformInput, 0), offsetDetected, keyPresses, 8.0, 512, 2*1024, true) == false) {
+                printf("Failed to detect keypresses\n");
+                return -2;
+            }
+
+            if (updateSimilarityMap(2*256, 3*32, 2*256 - 128, keyPressesOld, keyPresses, similarityMap) == false) {
+                printf("Failed to calculate similariy map\n");
+                return -3;
+            }
+
+            printf("[+] Streamed %6.2f seconds, key presses so far = %d\n", (float)(waveformInputF.size())/sampleRate, (int) keyPresses.size());
+        }
+
+        const auto tEnd = std::chrono::high_resolution_clock::now();
+
+        printf("[+] Stream ended after %4.3f seconds\n", toSeconds(tStart, tEnd));
+    } else {
         TWaveformF waveformInputF;
         printf("[+] Loading recording from '%s'\n", argv[1]);
         if (readFromFile<TSampleF>(argv[1], waveformInputF) == false) {
@@ -62,8 +166,7 @@ int main(int argc, char ** argv) {
     printf("    Total number of samples: %d\n", (int) waveformInput.size());
     printf("    Recording length:        %g seconds\n", (float)(waveformInput.size())/sampleRate);
 
-    TKeyPressCollection keyPresses;
-    {
+    if (streamInput == false) {
         const auto tStart = std::chrono::high_resolution_clock::now();
 
         printf("[+] Searching for key presses\n");
@@ -83,20 +186,21 @@ int main(int argc, char ** argv) {
 
     const int n = keyPresses.size();
 
-    TSimilarityMap similarityMap;
     {
-        const auto tStart = std::chrono::high_resolution_clock::now();
+        if (streamInput == false) {
+            const auto tStart = std::chrono::high_resolution_clock::now();
 
-        printf("[+] Calculating CC similarity map\n");
+            printf("[+] Calculating CC similarity map\n");
 
-        if (calculateSimilartyMap(2*256, 3*32, 2*256 - 128, keyPresses, similarityMap) == false) {
-            printf("Failed to calculate similariy map\n");
-            return -3;
-        }
+            if (calculateSimilartyMap(2*256, 3*32, 2*256 - 128, keyPresses, similarityMap) == false) {
+                printf("Failed to calculate similariy map\n");
+                return -3;
+            }
 
-        const auto tEnd = std::chrono::high_resolution_clock::now();
+            const auto tEnd = std::chrono::high_resolution_clock::now();
 
-        printf("[+] Calculation took %4.3f seconds\n", toSeconds(tStart, tEnd));
+            printf("[+] Calculation took %4.3f seconds\n", toSeconds(tStart, tEnd));
+        }
 
         const int ncc = std::min(32, n);
         for (int j = 0; j < ncc; ++j) {
@@ -120,52 +224,21 @@ int main(int argc, char ** argv) {
         printf("[+] Similarity map: min = %g, max = %g\n", minCC, maxCC);
     }
 
-    Cipher::TFreqMap freqMap6;
     {
-        const auto tStart = std::chrono::high_resolution_clock::now();
-
-        printf("[+] Loading n-grams from '%s'\n", argv[2]);
-
-        if (Cipher::loadFreqMapBinary((std::string(argv[2]) + "/ggwords-6-gram.dat.binary").c_str(), freqMap6) == false) {
-            return -5;
-        }
-
-        const auto tEnd = std::chrono::high_resolution_clock::now();
-
-        printf("[+] Loading took %4.3f seconds\n", toSeconds(tStart, tEnd));
-    }
-
-    {
-        Cipher::Processor processor;
-
         Cipher::TParameters params;
         params.maxClusters = 29;
         params.wEnglishFreq = 20.0;
         params.nHypothesesToKeep = std::max(100, 2100 - 10*std::min(200, std::max(0, ((int) keyPresses.size() - 100))));
-        processor.init(params, freqMap6, similarityMap);
+        params.nThreads = std::max(1, (int) std::thread::hardware_concurrency());
 
         printf("[+] Attempting to recover the text from the recording ...\n");
 
         std::vector<Cipher::TResult> clusterings;
 
-        // clustering
-        {
-            const auto tStart = std::chrono::high_resolution_clock::now();
-
-            for (int nIter = 0; nIter < 16; ++nIter) {
-                auto clusteringsCur = processor.getClusterings(params, 32);
-
-                for (int i = 0; i < (int) clusteringsCur.size(); ++i) {
-                    printf("[+] Clustering %d: pClusters = %g\n", i, clusteringsCur[i].pClusters);
-                    clusterings.push_back(std::move(clusteringsCur[i]));
-                }
-
-                params.maxClusters = 29 + 4*(nIter + 1);
-                processor.init(params, freqMap6, similarityMap);
-            }
-
-            const auto tEnd = std::chrono::high_resolution_clock::now();
-            printf("[+] Clustering took %4.3f seconds\n", toSeconds(tStart, tEnd));
+        // one simulated annealing chain per maxClusters value
+        std::vector<int> maxClusters;
+        for (int nIter = 0; nIter < 16; ++nIter) {
+            maxClusters.push_back(29 + 4*nIter);
         }
 
         params.hint.clear();
@@ -173,14 +246,17 @@ int main(int argc, char ** argv) {
 
         [[maybe_unused]] int nConverged = 0;
         while (true) {
-            // beam search
+            // clustering + beam search
             {
-                for (int i = 0; i < (int) clusterings.size(); ++i) {
-                    Cipher::beamSearch(params, freqMap6, clusterings[i]);
-                    printf("%8.3f %8.3f ", clusterings[i].p, clusterings[i].pClusters);
-                    Cipher::printDecoded(clusterings[i].clusters, clusterings[i].clMap, params.hint);
-                    Cipher::refineNearby(params, freqMap6, clusterings[i]);
-                }
+                const auto tStart = std::chrono::high_resolution_clock::now();
+
+                clusterings.clear();
+
+                Cipher::decodePipelined(params, freqMap6, similarityMap, maxClusters, 32, nReplicas, 2*params.nThreads,
+                                        Cipher::getPrintDecodedCallback(params.hint, clusterings));
+
+                const auto tEnd = std::chrono::high_resolution_clock::now();
+                printf("[+] Decoding %d clusterings took %4.3f seconds\n", (int) clusterings.size(), toSeconds(tStart, tEnd));
             }
             break;
 
@@ -14,6 +14,7 @@ int main(int argc, char ** argv) {
     srand(time(0));
 
     Cipher::TParameters params;
+    params.rng.seed(time(0));
 
     Cipher::TFreqMap freqMap;
     if (Cipher::loadFreqMap(argv[1], freqMap) == false) {
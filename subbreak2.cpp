@@ -7,10 +7,13 @@
 
 #include <array>
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
 #include <fstream>
 #include <chrono>
 #include <cassert>
 #include <algorithm>
+#include <set>
 
 namespace {
 
@@ -335,12 +338,12 @@ namespace {
 
 // generate k random distinct ints in [0..n)
 [[maybe_unused]]
-std::vector<int> subset(int k, int n) {
+std::vector<int> subset(TRandom & rng, int k, int n) {
     std::vector<int> res(k);
     for (int i = 0; i < k; ++i) res[i] = i;
 
     for (int i = k; i < n; ++i) {
-        const int j = rand()%(i + 1);
+        const int j = rng.uniform(i + 1);
         if (j < k) {
             res[j] = i;
         }
@@ -350,13 +353,13 @@ std::vector<int> subset(int k, int n) {
 }
 
 template <typename T>
-void shuffle(T & t, int start = -1, int end = -1, const Cipher::THint & hint = {}) {
+void shuffle(TRandom & rng, T & t, int start = -1, int end = -1, const Cipher::THint & hint = {}) {
     if (start == -1) start = 0;
     if (end == -1) end = t.size();
 
     for (int i = end - 1; i > start; --i) {
         int i0 = i;
-        int i1 = rand()%(i - start + 1)+start;
+        int i1 = rng.uniform(i - start + 1) + start;
         if (hint.size() > 0 && (hint[i0] != -1 || hint[i1] != -1)) {
             continue;
         }
@@ -366,7 +369,7 @@ void shuffle(T & t, int start = -1, int end = -1, const Cipher::THint & hint = {
 
 void calcHelpers(
         const Cipher::TParameters & params,
-        const TClusterToLetterMap & clMap,
+        const Cipher::TClusterToLetterArray & clMap,
         const TClusters & clusters,
         Cipher::TPlainText & plainText,
         Cipher::TLetterCount & letterCount,
@@ -392,7 +395,7 @@ void calcHelpers(
 
     nLetters = 0;
     for (int i = 0; i < n; ++i) {
-        plainText[i] = clMap.at(clusters[i]);
+        plainText[i] = clMap[clusters[i]];
         if (plainText[i] > 0 && plainText[i] <= 26) {
             ++letterCount[plainText[i]];
             ++nLetters;
@@ -421,13 +424,13 @@ void updateHelpers(
         const Cipher::TClusterPos & clusterPos,
         const int nLetters,
         int c0, int c1,
-        TClusterToLetterMap & clMap,
+        Cipher::TClusterToLetterArray & clMap,
         Cipher::TPlainText & plainText,
         Cipher::TLetterCount & letterCount,
         float & letterFreqCost) {
 
-    int p0 = clMap.at(c0);
-    int p1 = clMap.at(c1);
+    int p0 = clMap[c0];
+    int p1 = clMap[c1];
 
     int nc0 = clusterCount[c0];
     int nc1 = clusterCount[c1];
@@ -435,8 +438,8 @@ void updateHelpers(
     letterCount[p0] += nc1 - nc0;
     letterCount[p1] += nc0 - nc1;
 
-    clMap.at(c0) = p1;
-    clMap.at(c1) = p0;
+    clMap[c0] = p1;
+    clMap[c1] = p0;
 
     for (auto & i : clusterPos[c0]) plainText[i] = p1;
     for (auto & i : clusterPos[c1]) plainText[i] = p0;
@@ -454,6 +457,380 @@ void updateHelpers(
     letterFreqCost = sqrt(letterFreqCost);
 }
 
+// calcScoreUpdate re-scores the whole text when more than 1/kDenseUpdateFactor of it is within len letters of a change
+constexpr int kDenseUpdateFactor = 4;
+
+// state for the incremental evaluation of calcScore0 - see calcScoreHelpers / calcScoreUpdate / commitScoreUpdate
+struct TScoreCounts {
+    std::array<int, 27> letterCount;
+
+    int nLetters = 0;
+    int nAlphabetic = 0;
+    int nNonAlphabetic = 0;
+
+    // sum of the n-gram log-probabilities
+    double sumLM = 0.0;
+};
+
+struct TScoreHelpers {
+    Cipher::TPlainText plainText;
+    TScoreCounts counts;
+
+    // log-probability of the n-gram that ends at each position - 0 if there is none
+    std::vector<Cipher::TProb> windowProb;
+
+    // the change evaluated by the last calcScoreUpdate - (position, new letter), the n-grams with a new
+    // log-probability (end position, log-probability) and the new counts
+    std::vector<std::pair<int, TLetter>> changed;
+    std::vector<std::pair<int, Cipher::TProb>> rescored;
+    TScoreCounts countsNew;
+
+    // set when the change touches most of the text - all n-grams are re-scored in windowProbNew instead
+    bool rescoredAll = false;
+    std::vector<Cipher::TProb> windowProbNew;
+
+    // work buffers
+    std::vector<int> positions;
+    std::vector<int> positionsTmp;
+};
+
+inline bool isAlphabetic(TLetter c) {
+    return c > 0 && c <= 26;
+}
+
+void addLetter(const Cipher::TParameters & params, TScoreCounts & counts, TLetter c, int d) {
+    if (isAlphabetic(c)) {
+        counts.letterCount[c] += d;
+        counts.nLetters += d;
+        counts.nAlphabetic += d;
+    } else {
+        if (params.includeSpaces) {
+            counts.letterCount[0] += d;
+            counts.nLetters += d;
+        }
+        counts.nNonAlphabetic += d;
+    }
+}
+
+// same as calcScore0 for a text of length n with the given counts
+Cipher::TProb calcScore2(
+        const Cipher::TParameters & params,
+        const Cipher::TFreqMap & freqMap,
+        const TScoreCounts & counts,
+        int n) {
+    if (counts.nAlphabetic < freqMap.len) return -1e100;
+
+    float letFreqCost = 0.0;
+    {
+        auto & freq = params.includeSpaces ? kEnglishLetterWithSpacesFreq : kEnglishLetterFreq;
+        for (int i = 0; i < 27; ++i) {
+            float curf = 0.01*freq[i] - ((float)(counts.letterCount[i]))/((float)(counts.nLetters));
+            letFreqCost += curf*curf;
+        }
+    }
+
+    letFreqCost /= 27.0;
+    letFreqCost = sqrt(letFreqCost);
+
+    const Cipher::TProb res = counts.sumLM + counts.nNonAlphabetic*params.pNonAlphabetic;
+
+    return res/n - params.wEnglishFreq*letFreqCost;
+}
+
+// log-probabilities of the n-grams that end at positions [i0, i1] of the text clMap[clusters[i]]
+// they are stored in res[0..i1 - i0] and their sum is returned
+double calcRangeProb(
+        const Cipher::TFreqMap & freqMap,
+        const TClusters & clusters,
+        const Cipher::TClusterToLetterArray & clMap,
+        int i0, int i1,
+        Cipher::TProb * res) {
+    const int len = freqMap.len;
+    const Cipher::TCode mask = (1 << 5*len) - 1;
+
+    // the letters of the first n-gram that precede the range
+    int k = 0;
+    int i = i0 - 1;
+    while (i >= 0 && k < len - 1) {
+        if (isAlphabetic(clMap[clusters[i]])) ++k;
+        --i;
+    }
+
+    Cipher::TCode curc = 0;
+    for (++i; i < i0; ++i) {
+        const auto c = clMap[clusters[i]];
+        if (isAlphabetic(c)) curc = (curc << 5) + c;
+    }
+
+    double sum = 0.0;
+    for (i = i0; i <= i1; ++i) {
+        const auto c = clMap[clusters[i]];
+
+        Cipher::TProb p = 0.0;
+        if (isAlphabetic(c)) {
+            curc = ((curc << 5) + c) & mask;
+            if (++k >= len) p = freqMap.get(curc);
+        }
+
+        res[i - i0] = p;
+        sum += p;
+    }
+
+    return sum;
+}
+
+void calcScoreHelpers(
+        const Cipher::TParameters & params,
+        const Cipher::TFreqMap & freqMap,
+        const TClusters & clusters,
+        const Cipher::TClusterToLetterArray & clMap,
+        TScoreHelpers & helpers) {
+    const int n = clusters.size();
+
+    auto & counts = helpers.counts;
+
+    helpers.plainText.resize(n);
+
+    counts.letterCount.fill(0);
+    counts.nLetters = 0;
+    counts.nAlphabetic = 0;
+    counts.nNonAlphabetic = 0;
+
+    for (int i = 0; i < n; ++i) {
+        helpers.plainText[i] = clMap[clusters[i]];
+        addLetter(params, counts, helpers.plainText[i], 1);
+    }
+
+    helpers.windowProb.resize(n);
+    counts.sumLM = calcRangeProb(freqMap, clusters, clMap, 0, n - 1, helpers.windowProb.data());
+}
+
+// score of the text after the letters of the given clusters are changed to the ones in clMap
+// clusterPos - the sorted positions of each cluster (see calcHelpers)
+// only the n-grams that overlap the positions of these clusters are re-scored, so for sparse changes the cost does not
+// depend on the text length. the helpers keep the old text until the change is applied with commitScoreUpdate
+Cipher::TProb calcScoreUpdate(
+        const Cipher::TParameters & params,
+        const Cipher::TFreqMap & freqMap,
+        const TClusters & clusters,
+        const Cipher::TClusterToLetterArray & clMap,
+        const Cipher::TClusterPos & clusterPos,
+        const std::vector<TClusterId> & changedClusters,
+        TScoreHelpers & helpers) {
+    const int n = clusters.size();
+    const int len = freqMap.len;
+    const Cipher::TCode mask = (1 << 5*len) - 1;
+
+    const auto & plain = helpers.plainText;
+
+    auto & positions = helpers.positions;
+    positions.clear();
+    for (auto cid : changedClusters) {
+        helpers.positionsTmp.swap(positions);
+        positions.clear();
+        std::merge(helpers.positionsTmp.begin(), helpers.positionsTmp.end(),
+                   clusterPos[cid].begin(), clusterPos[cid].end(), std::back_inserter(positions));
+    }
+
+    auto & changed = helpers.changed;
+    auto & countsNew = helpers.countsNew;
+
+    changed.clear();
+    countsNew = helpers.counts;
+
+    for (auto i : positions) {
+        const auto c = clMap[clusters[i]];
+        if (plain[i] == c || (changed.empty() == false && changed.back().first == i)) continue;
+
+        changed.emplace_back(i, c);
+        addLetter(params, countsNew, plain[i], -1);
+        addLetter(params, countsNew, c, 1);
+    }
+
+    auto & rescored = helpers.rescored;
+    rescored.clear();
+
+    const int nChanged = changed.size();
+
+    // with dense changes, the bookkeeping below costs more than a plain pass over the whole text
+    helpers.rescoredAll = kDenseUpdateFactor*nChanged*len > n;
+    if (helpers.rescoredAll) {
+        helpers.windowProbNew.resize(n);
+        countsNew.sumLM = calcRangeProb(freqMap, clusters, clMap, 0, n - 1, helpers.windowProbNew.data());
+
+        return calcScore2(params, freqMap, countsNew, n);
+    }
+
+    // the n-grams that contain a changed position i end at one of the first len letters at or after i - in the old
+    // or in the new text. they are re-scored in a single pass over the new text, which skips the long gaps between them
+
+    int k = 0;
+    int iChanged = 0;
+    int remOld = 0;
+    int remNew = 0;
+    Cipher::TCode curc = 0;
+    for (int q = 0; q < n; ++q) {
+        if (remOld == 0 && remNew == 0) {
+            if (iChanged == nChanged) break;
+
+            if (q == 0 || changed[iChanged].first - q > 4*len) {
+                // the letters of the first n-gram that precede the next changed position
+                q = changed[iChanged].first;
+
+                k = 0;
+                int i = q - 1;
+                while (i >= 0 && k < len - 1) {
+                    if (isAlphabetic(clMap[clusters[i]])) ++k;
+                    --i;
+                }
+
+                curc = 0;
+                for (++i; i < q; ++i) {
+                    const auto c = clMap[clusters[i]];
+                    if (isAlphabetic(c)) curc = (curc << 5) + c;
+                }
+            }
+        }
+
+        if (iChanged < nChanged && q == changed[iChanged].first) {
+            remOld = len;
+            remNew = len;
+            ++iChanged;
+        }
+
+        const auto c = clMap[clusters[q]];
+        const bool isNew = isAlphabetic(c);
+        const bool isOld = isAlphabetic(plain[q]);
+
+        if (isNew) {
+            curc = ((curc << 5) + c) & mask;
+            ++k;
+        }
+
+        if (remOld > 0 || remNew > 0) {
+            const Cipher::TProb p = isNew && k >= len ? freqMap.get(curc) : 0.0;
+            if (p != helpers.windowProb[q]) {
+                rescored.emplace_back(q, p);
+                countsNew.sumLM += p - helpers.windowProb[q];
+            }
+
+            remOld -= isOld && remOld > 0;
+            remNew -= isNew && remNew > 0;
+        }
+    }
+
+    return calcScore2(params, freqMap, countsNew, n);
+}
+
+// applies the change evaluated by the last call to calcScoreUpdate
+void commitScoreUpdate(TScoreHelpers & helpers) {
+    for (const auto & c : helpers.changed) {
+        helpers.plainText[c.first] = c.second;
+    }
+
+    if (helpers.rescoredAll) {
+        helpers.windowProb.swap(helpers.windowProbNew);
+    } else {
+        for (const auto & r : helpers.rescored) {
+            helpers.windowProb[r.first] = r.second;
+        }
+    }
+
+    helpers.counts = helpers.countsNew;
+
+    helpers.changed.clear();
+    helpers.rescored.clear();
+}
+
+// IEEE 754 half precision, rounded to nearest - see TFreqMap::halfToFloat
+uint16_t floatToHalf(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+
+    const uint32_t sign = (x >> 16) & 0x8000;
+    const int32_t exp = (int32_t) ((x >> 23) & 0xff) - 127 + 15;
+    const uint32_t mant = x & 0x7fffff;
+
+    if (exp <= 0) return sign;
+    if (exp >= 31) return sign | 0x7bff;
+
+    // a carry out of the mantissa increments the exponent
+    uint32_t res = (((uint32_t) exp) << 10) | (mant >> 13);
+    res += (mant >> 12) & 1;
+
+    return sign | std::min(res, 0x7bffu);
+}
+
+// (code, log-probability) of the n-grams in the model, sorted by code
+using TFreqEntries = std::vector<std::pair<Cipher::TCode, Cipher::TProb>>;
+
+// fills the given (non-quantized) storage of freqMap - the codes missing from entries get probability pmin
+void buildFreqMapStorage(Cipher::TFreqMap & freqMap, const TFreqEntries & entries, Cipher::TFreqMap::EStorage storage) {
+    using TFreqMap = Cipher::TFreqMap;
+
+    const int64_t nCodes = 1ll << (5*freqMap.len);
+    const auto pmin = freqMap.pmin;
+
+    auto & maxError = freqMap.maxQuantError;
+    maxError = 0.0;
+
+    switch (storage) {
+        case TFreqMap::DenseF32:
+            {
+                freqMap.probF32.assign(nCodes, (float) pmin);
+                maxError = std::fabs(pmin - (float) pmin);
+                for (const auto & e : entries) {
+                    freqMap.probF32[e.first] = e.second;
+                    maxError = std::max(maxError, std::fabs(e.second - (float) e.second));
+                }
+            }
+            break;
+        case TFreqMap::DenseF16:
+            {
+                freqMap.probF16.assign(nCodes, floatToHalf(pmin));
+                maxError = std::fabs(pmin - TFreqMap::halfToFloat(floatToHalf(pmin)));
+                for (const auto & e : entries) {
+                    freqMap.probF16[e.first] = floatToHalf(e.second);
+                    maxError = std::max(maxError, std::fabs(e.second - TFreqMap::halfToFloat(freqMap.probF16[e.first])));
+                }
+            }
+            break;
+        case TFreqMap::Sparse:
+            {
+                // about 2-4 n-grams per bucket, but not more buckets than (n - 1)-gram prefixes
+                int nBucketBits = 0;
+                while ((4ll << nBucketBits) <= (int64_t) entries.size() && nBucketBits < 5*(freqMap.len - 1)) ++nBucketBits;
+
+                freqMap.sparseShift = 5*freqMap.len - nBucketBits;
+                freqMap.sparseOffsets.assign((1 << nBucketBits) + 1, 0);
+                freqMap.sparse.resize(entries.size());
+
+                for (int i = 0; i < (int) entries.size(); ++i) {
+                    const auto & e = entries[i];
+                    freqMap.sparse[i] = { e.first, (float) e.second };
+                    ++freqMap.sparseOffsets[(e.first >> freqMap.sparseShift) + 1];
+                    maxError = std::max(maxError, std::fabs(e.second - (float) e.second));
+                }
+
+                for (int b = 0; b < (1 << nBucketBits); ++b) {
+                    freqMap.sparseOffsets[b + 1] += freqMap.sparseOffsets[b];
+                }
+            }
+            break;
+        default:
+            {
+                storage = TFreqMap::Dense;
+                freqMap.prob.assign(nCodes, pmin);
+                for (const auto & e : entries) {
+                    freqMap.prob[e.first] = e.second;
+                }
+            }
+            break;
+    }
+
+    freqMap.storage = storage;
+}
+
 }
 
 namespace Cipher {
@@ -463,12 +840,20 @@ namespace Cipher {
         return res;
     }
 
-    bool loadFreqMap(const char * fname, TFreqMap & res) {
-        auto & len = res.len;
-        auto & prob = res.prob;
+    TClusterToLetterMap toClusterToLetterMap(const TClusterToLetterArray & clArray) {
+        TClusterToLetterMap res;
+        for (int i = 0; i < (int) clArray.size(); ++i) {
+            res[i] = clArray[i];
+        }
+
+        return res;
+    }
+
+    bool loadFreqMap(const char * fname, TFreqMap & res, TFreqMap::EStorage storage) {
+        res = {};
 
+        auto & len = res.len;
         len = 0;
-        prob.clear();
 
         printf("[+] Loading n-gram file '%s'\n", fname);
         std::ifstream fin(fname);
@@ -480,6 +865,7 @@ namespace Cipher {
 
         std::string gram;
         int32_t nfreq = 0;
+        int64_t nGrams = 0;
         res.nTotal = 0;
 
         while (true) {
@@ -487,42 +873,146 @@ namespace Cipher {
             if (fin.eof()) break;
 
             res.nTotal += nfreq;
+            ++nGrams;
         }
 
         fin.clear();
         fin.seekg(0);
 
+        TFreqEntries entries;
+        entries.reserve(nGrams);
+
         while (true) {
             fin >> gram >> nfreq;
             if (fin.eof()) break;
 
             if (len == 0) {
                 len = gram.size();
-                prob.resize(1 << (5*len), 1.0);
             } else if (len != (int) gram.size()) {
                 printf("Error: loaded n-grams with vaying lengths\n");
                 return false;
             }
 
-            TCode idx = calcCode(gram.data(), len);
-            if (prob[idx] < 0.5) {
+            entries.emplace_back(calcCode(gram.data(), len), std::log10(((double)(nfreq))/res.nTotal));
+        }
+        printf("    Total n-grams loaded = %g\n", (double) res.nTotal);
+
+        std::sort(entries.begin(), entries.end());
+        for (int i = 1; i < (int) entries.size(); ++i) {
+            if (entries[i - 1].first == entries[i].first) {
+                for (int j = 0; j < len; ++j) gram[j] = 'a' + ((entries[i].first >> 5*(len - j - 1)) & 31) - 1;
                 printf("Error: duplicate n-gram '%s'\n", gram.c_str());
                 return false;
             }
-            prob[idx] = std::log10(((double)(nfreq))/res.nTotal);
         }
-        printf("    Total n-grams loaded = %g\n", (double) res.nTotal);
 
         res.pmin = std::log(10000000.01/res.nTotal);
         printf("    P-min = %g\n", res.pmin);
-        for (auto & p : prob) {
-            if (p >= 0.5) p = res.pmin;
+
+        if (len == 0) {
+            return true;
+        }
+
+        bool quantize16 = storage == TFreqMap::Quantized;
+        if (storage == TFreqMap::Auto) {
+            const int64_t nCodes = 1ll << (5*len);
+            const int64_t sizeDense = nCodes*sizeof(TProb);
+            const int64_t sizeSparse = entries.size()*sizeof(TFreqMap::TSparseEntry) + entries.size()*sizeof(uint32_t)/4;
+            const int64_t sizeQuantized = nCodes*sizeof(uint16_t);
+
+            // a sparse lookup costs two dependent memory accesses instead of one, so it is used only when
+            // it saves a lot of memory - typically for n-gram lengths above 5
+            if (sizeDense <= kFreqMapMaxDenseSize_MB*1024*1024) {
+                storage = TFreqMap::Dense;
+            } else {
+                storage = TFreqMap::Sparse;
+                quantize16 = sizeQuantized < 4*sizeSparse;
+            }
+        }
+
+        // the quantized form is built from the sparse one, which is much smaller than a dense table of doubles
+        buildFreqMapStorage(res, entries, quantize16 ? TFreqMap::Sparse : storage);
+        entries = {};
+
+        if (quantize16) {
+            return quantizeFreqMap(res, 16);
         }
 
+        printf("    Storage = %s, max error = %g\n",
+               res.storage == TFreqMap::DenseF32 ? "dense float" :
+               res.storage == TFreqMap::DenseF16 ? "dense half" :
+               res.storage == TFreqMap::Sparse ? "sparse" : "dense", res.maxQuantError);
+
         return true;
     }
 
-    bool encryptExact(const TParameters & , const std::string & text, TClusters & clusters) {
+    bool quantizeFreqMap(TFreqMap & res, int nQuantBits) {
+        if (nQuantBits != 8 && nQuantBits != 16) {
+            printf("Error: unsupported number of quantization bits - %d\n", nQuantBits);
+            return false;
+        }
+
+        const int64_t nCodes = 1ll << (5*res.len);
+
+        // the codebook is built from the stored values, so their error adds up
+        // this also allows an already quantized map to be re-quantized to fewer bits
+        double maxError = 0.0;
+        std::vector<TProb> codebook;
+
+        // the codebook depends only on the distinct values, so the sparse form does not need a dense copy
+        {
+            std::vector<TProb> values;
+            if (res.storage == TFreqMap::Sparse) {
+                values.reserve(res.sparse.size() + 1);
+                values.push_back(res.pmin);
+                for (const auto & e : res.sparse) values.push_back(e.prob);
+            } else if (res.storage == TFreqMap::Quantized) {
+                values = res.codebook;
+            } else {
+                values.resize(nCodes);
+                for (int64_t i = 0; i < nCodes; ++i) values[i] = res.get(i);
+            }
+
+            codebook = calcQuantizationCodebook(values, 1 << nQuantBits, maxError);
+        }
+
+        auto fill = [&](auto & q) {
+            q.resize(nCodes);
+            if (res.storage == TFreqMap::Sparse) {
+                std::fill(q.begin(), q.end(), quantize(res.pmin, codebook));
+                for (const auto & e : res.sparse) q[e.code] = quantize((TProb) e.prob, codebook);
+            } else {
+                for (int64_t i = 0; i < nCodes; ++i) q[i] = quantize(res.get(i), codebook);
+            }
+        };
+
+        std::vector<uint8_t> probQ8;
+        std::vector<uint16_t> probQ16;
+        if (nQuantBits == 8) {
+            fill(probQ8);
+        } else {
+            fill(probQ16);
+        }
+
+        res.storage = TFreqMap::Quantized;
+        res.maxQuantError += maxError;
+        res.nQuantBits = nQuantBits;
+        res.codebook = std::move(codebook);
+        res.probQ8 = std::move(probQ8);
+        res.probQ16 = std::move(probQ16);
+        res.prob = {};
+        res.probF32 = {};
+        res.probF16 = {};
+        res.sparseOffsets = {};
+        res.sparse = {};
+
+        printf("    Quantized %d-gram map to %d bits: codebook size = %d, max error = %g\n",
+               res.len, nQuantBits, (int) res.codebook.size(), res.maxQuantError);
+
+        return true;
+    }
+
+    bool encryptExact(TParameters & params, const std::string & text, TClusters & clusters) {
         auto myCharToLetter = kCharToLetter;
 
 		int k = 26;
@@ -540,7 +1030,7 @@ namespace Cipher {
 			alphabetTransformation[i] = i;
 		}
 
-		shuffle(alphabetTransformation);
+		shuffle(params.rng, alphabetTransformation);
 
 		clusters.resize(text.size());
 
@@ -554,7 +1044,7 @@ namespace Cipher {
         return true;
     }
 
-	bool generateSimilarityMap(const TParameters & params, const std::string & text, TSimilarityMap & ccMap) {
+	bool generateSimilarityMap(TParameters & params, const std::string & text, TSimilarityMap & ccMap) {
 		int n = text.size();
 
 		ccMap.clear();
@@ -564,14 +1054,14 @@ namespace Cipher {
 		std::vector<float> waveformAccuracy(n);
 
 		for (int i = 0; i < n; ++i) {
-			float pError = frand();
+			float pError = params.rng.frand();
 			if (pError < params.waveformDetectionErrorP) {
-				waveformAccuracy[i] = 1.0 - params.waveformDetectionErrorMin - frand()*(params.waveformDetectionErrorSig);
+				waveformAccuracy[i] = 1.0 - params.waveformDetectionErrorMin - params.rng.frand()*(params.waveformDetectionErrorSig);
 			} else {
-				waveformAccuracy[i] = 1.0 - params.waveformDeviationMin - frand()*(params.waveformDeviationSig);
+				waveformAccuracy[i] = 1.0 - params.waveformDeviationMin - params.rng.frand()*(params.waveformDeviationSig);
 			}
 
-			waveformAccuracy[i] += 2.0f*(0.5f - frand())*params.similarityNoiseSig;
+			waveformAccuracy[i] += 2.0f*(0.5f - params.rng.frand())*params.similarityNoiseSig;
 			waveformAccuracy[i] = std::max(0.0f, waveformAccuracy[i]);
 			waveformAccuracy[i] = std::min(1.0f, waveformAccuracy[i]);
 		}
@@ -585,7 +1075,7 @@ namespace Cipher {
 				}
 
 				if (text[i] != text[j]) {
-					float sim = params.similarityMismatchAvg + 2.0f*(0.5f - frand())*params.similarityMismatchSig;
+					float sim = params.similarityMismatchAvg + 2.0f*(0.5f - params.rng.frand())*params.similarityMismatchSig;
 
 					ccMap[i][j].cc = sim;
 					ccMap[j][i].cc = sim;
@@ -675,17 +1165,16 @@ namespace Cipher {
         return -res;
     }
 
-    TProb calcScore0(const TParameters & params, const TFreqMap & freqMap, const TClusters & txt, const TClusterToLetterMap & clMap) {
+    TProb calcScore0(const TParameters & params, const TFreqMap & freqMap, const TClusters & txt, const TClusterToLetterArray & clMap) {
         const int n = txt.size();
         const auto & len  = freqMap.len;
-        const auto & prob = freqMap.prob;
 
         int nlet = 0;
         std::array<int, 27> letCount;
         letCount.fill(0);
         std::vector<TLetter> plain(n);
         for (int i = 0; i < n; ++i) {
-            plain[i] = clMap.at(txt[i]);
+            plain[i] = clMap[txt[i]];
             if (plain[i] > 0 && plain[i] <= 26) {
                 ++letCount[plain[i]];
                 ++nlet;
@@ -727,7 +1216,7 @@ namespace Cipher {
             }
         }
 
-        res += prob[curc];
+        res += freqMap.get(curc);
         while (true) {
             curc &= mask;
 
@@ -743,12 +1232,75 @@ namespace Cipher {
                 }
             }
 
-            res += prob[curc];
+            res += freqMap.get(curc);
         }
 
         return res/n - params.wEnglishFreq*letFreqCost;
     }
 
+    double checkScoreUpdate(TParameters & params, const TFreqMap & freqMap, const TClusters & clusters, int nUpdates) {
+        const int n = clusters.size();
+
+        for (const auto & cid : clusters) {
+            assert(cid >= 0 && cid < params.maxClusters);
+        }
+
+        // a quarter of the letters are non-alphabetic, so that the n-gram windows often skip some positions
+        const auto randomLetter = [&]() { return params.rng.uniform(4) == 0 ? 0 : 1 + params.rng.uniform(26); };
+
+        TClusterToLetterArray clArray(params.maxClusters);
+        for (auto & c : clArray) {
+            c = randomLetter();
+        }
+
+        TClusterPos clusterPos(params.maxClusters);
+        for (int i = 0; i < n; ++i) {
+            clusterPos[clusters[i]].push_back(i);
+        }
+
+        TScoreHelpers helpers;
+        calcScoreHelpers(params, freqMap, clusters, clArray, helpers);
+
+        std::vector<TClusterId> changedClusters;
+
+        double maxDiff = 0.0;
+        for (int iter = 0; iter < nUpdates; ++iter) {
+            const auto clArraySave = clArray;
+
+            // the moves of the annealing loops - a swap of two letters or a new letter for one cluster - and every
+            // 16th update a change of many clusters at once, which takes the dense path of calcScoreUpdate
+            changedClusters.clear();
+            const int nMoves = iter % 16 == 0 ? params.maxClusters/2 : 1;
+            for (int k = 0; k < nMoves; ++k) {
+                const int i2 = params.rng.uniform(params.maxClusters);
+                const int i3 = params.rng.uniform(params.maxClusters);
+                if (params.rng.uniform(2) == 0) {
+                    std::swap(clArray[i2], clArray[i3]);
+                    changedClusters.push_back(i2);
+                    changedClusters.push_back(i3);
+                } else {
+                    clArray[i2] = randomLetter();
+                    changedClusters.push_back(i2);
+                }
+            }
+
+            const double pUpdate = calcScoreUpdate(params, freqMap, clusters, clArray, clusterPos, changedClusters, helpers);
+            const double pFull = calcScore0(params, freqMap, clusters, clArray);
+            if (pUpdate != pFull) {
+                maxDiff = std::max(maxDiff, std::fabs(pUpdate - pFull));
+            }
+
+            // keep about half of the changes, so that the helpers are checked against a text that keeps evolving
+            if (params.rng.uniform(2) == 0) {
+                commitScoreUpdate(helpers);
+            } else {
+                clArray = clArraySave;
+            }
+        }
+
+        return maxDiff;
+    }
+
     TProb calcScore1(
             const TParameters & params,
             const TFreqMap & freqMap,
@@ -758,7 +1310,6 @@ namespace Cipher {
 
         const int n = plain.size();
         const auto & len  = freqMap.len;
-        const auto & prob = freqMap.prob;
 
         //printf("letFreqCost = %g\n", letFreqCost);
 
@@ -779,7 +1330,7 @@ namespace Cipher {
             }
         }
 
-        res += prob[curc];
+        res += freqMap.get(curc);
         while (true) {
             curc &= mask;
 
@@ -795,14 +1346,14 @@ namespace Cipher {
                 }
             }
 
-            res += prob[curc];
+            res += freqMap.get(curc);
         }
 
         return res/n - params.wEnglishFreq*letFreqCost;
     }
 
     bool doSimulatedAnnealing3(
-        const TParameters & params,
+        TParameters & params,
         const TSimilarityMap & ccMap,
         TClusters & clusters
         ) {
@@ -892,11 +1443,11 @@ namespace Cipher {
 
                 clustersNew = clusters;
 
-                int i0 = rand()%n;
-                int i1 = rand()%n;
+                int i0 = params.rng.uniform(n);
+                int i1 = params.rng.uniform(n);
                 while (clusters[i0] == clusters[i1] || ccMap[i0][i1].cc < ccavg) {
-                    i0 = rand()%n;
-                    i1 = rand()%n;
+                    i0 = params.rng.uniform(n);
+                    i1 = params.rng.uniform(n);
                 }
 
                 int cid0 = clusters[i0];
@@ -930,7 +1481,7 @@ namespace Cipher {
                 cost1 += 1.0f*n0*n1*(1.0f - ccavg);
 
                 float delta = cost1 - cost0;
-                if (delta > 0 || (std::exp(delta/temp) > frand())) {
+                if (delta > 0 || (std::exp(delta/temp) > params.rng.frand())) {
                     printf("merge %d size %d      -  %d size %d\n", cid0, n0, cid1, n1);
                     cost0 = cost1 - 1.0f*n0*n1*(1.0f - ccavg);
                     clusters = clustersNew;
@@ -942,14 +1493,14 @@ namespace Cipher {
                 float costBest = -1e10;
                 float costCur = cost0;
                 for (int k = 0; k < params.nChangePerIteration; ++k) {
-                    int i = rand()%n;
+                    int i = params.rng.uniform(n);
                     while (params.hint[i] >= 0) {
-                        i = rand()%n;
+                        i = params.rng.uniform(n);
                     }
 
                     int cid = clustersNew[i];
                     while (cid == clustersNew[i]) {
-                        clustersNew[i] = rand()%params.maxClusters;
+                        clustersNew[i] = params.rng.uniform(params.maxClusters);
                     }
 
                     costCur = costFUpdate(ccMap, clustersNew, i, cid, costCur);
@@ -963,7 +1514,7 @@ namespace Cipher {
                 float cost1 = costBest;
 
                 float delta = cost1 - cost0;
-                if (delta > 0 || (std::exp(delta/temp) > frand())) {
+                if (delta > 0 || (std::exp(delta/temp) > params.rng.frand())) {
                     cost0 = cost1;
                     clusters = clustersBest;
                 }
@@ -976,7 +1527,7 @@ namespace Cipher {
     }
 
     bool doSimulatedAnnealing4(
-        const TParameters & params,
+        TParameters & params,
         const TFreqMap & freqMap,
         const TClusters & clusters,
         TClusterToLetterMap & clMap
@@ -984,15 +1535,20 @@ namespace Cipher {
 
         int n = clusters.size();
 
-        clMap.clear();
+        // the arrays below are indexed by cluster id - the clusters come from the caller (e.g. a loaded checkpoint)
+        for (const auto & cid : clusters) {
+            assert(cid >= 0 && cid < params.maxClusters);
+        }
+
+        TClusterToLetterArray clArray(params.maxClusters, 0);
         std::map<TLetter, bool> used;
-        std::map<TClusterId, bool> fixed;
+        std::vector<bool> fixed(params.maxClusters, false);
         for (int i = 0; i < (int) params.hint.size(); ++i) {
             if (params.hint[i] < 0) continue;
             //if (used[params.hint[i]]) continue;
             if (fixed[clusters[i]]) continue;
 
-            clMap[clusters[i]] = params.hint[i];
+            clArray[clusters[i]] = params.hint[i];
             used[params.hint[i]] = true;
             fixed[clusters[i]] = true;
             printf("Fixed %d\n", clusters[i]);
@@ -1003,22 +1559,36 @@ namespace Cipher {
             for (int i = 0; i < params.maxClusters; ++i) {
                 if (fixed[i]) continue;
                 while (used[ii]) ++ii;
-                clMap[i] = ii++;
+                clArray[i] = ii++;
             }
         }
 
+        TClusterPos clusterPos(params.maxClusters);
+        for (int i = 0; i < n; ++i) {
+            clusterPos[clusters[i]].push_back(i);
+        }
+
+        // the clusters changed in the current iteration
+        std::vector<TClusterId> changedClusters;
+
+        TScoreHelpers helpers;
+        calcScoreHelpers(params, freqMap, clusters, clArray, helpers);
+
         float temp = params.temp0;
-        float cost0 = calcScore0(params, freqMap, clusters, clMap);
+        float cost0 = calcScore2(params, freqMap, helpers.counts, n);
 
-        auto clMapSave = clMap;
-        auto clMapBest = clMap;
+        auto clArraySave = clArray;
+        auto clArrayBest = clArray;
 
         for (int iter = 0; iter < params.saMaxIterations; ++iter) {
             if (iter%5000 == 0) {
+                // discard the rounding errors accumulated by the incremental updates
+                calcScoreHelpers(params, freqMap, clusters, clArray, helpers);
+
                 printf("Iter %5d : temp = %16.4f, cost0 = %8.4f\n", iter, temp, cost0);
                 for (int i = 0; i < n; ++i) {
-                    if (clMap[clusters[i]] > 0 && clMap[clusters[i]] <= 26) {
-                        printf("%c", 'a'+clMap[clusters[i]]-1);
+                    if (clArray[clusters[i]] > 0 && clArray[clusters[i]] <= 26) {
+                        printf("%c", 'a'+clArray[clusters[i]]-1);
                     } else {
                         printf(".");
                     }
@@ -1026,37 +1596,41 @@ namespace Cipher {
                 printf("\n");
             }
 
-            clMapSave = clMap;
-            clMapBest = clMap;
+            clArraySave = clArray;
+            clArrayBest = clArray;
 
             float costBest = -1e10;
 
+            changedClusters.clear();
             for (int k = 0; k < 1; ++k) {
                 {
-                    int i2 = rand()%params.maxClusters;
-                    int i3 = rand()%params.maxClusters;
+                    int i2 = params.rng.uniform(params.maxClusters);
+                    int i3 = params.rng.uniform(params.maxClusters);
                     while (i2 == i3 || fixed[i2] || fixed[i3]) {
-                        i2 = rand()%params.maxClusters;
-                        i3 = rand()%params.maxClusters;
+                        i2 = params.rng.uniform(params.maxClusters);
+                        i3 = params.rng.uniform(params.maxClusters);
                     }
-                    std::swap(clMap[i2], clMap[i3]);
+                    std::swap(clArray[i2], clArray[i3]);
+                    changedClusters.push_back(i2);
+                    changedClusters.push_back(i3);
                 }
 
-                int i2 = rand()%params.maxClusters;
+                int i2 = params.rng.uniform(params.maxClusters);
                 while (fixed[i2]) {
-                    i2 = rand()%params.maxClusters;
+                    i2 = params.rng.uniform(params.maxClusters);
                 }
-                int letterNew = rand()%27;
-                while (clMap[i2] == letterNew) {
-                    letterNew = rand()%27;
+                int letterNew = params.rng.uniform(27);
+                while (clArray[i2] == letterNew) {
+                    letterNew = params.rng.uniform(27);
                 }
 
-                clMap[i2] = letterNew;
+                clArray[i2] = letterNew;
+                changedClusters.push_back(i2);
 
-                float costCur = calcScore0(params, freqMap, clusters, clMap);
+                float costCur = calcScoreUpdate(params, freqMap, clusters, clArray, clusterPos, changedClusters, helpers);
                 if (costCur > costBest) {
                     costBest = costCur;
-                    clMapBest = clMap;
+                    clArrayBest = clArray;
                 }
             }
 
@@ -1078,20 +1652,23 @@ namespace Cipher {
             //    }
             //}
 
-            clMap = clMapBest;
+            clArray = clArrayBest;
 
             float cost1 = costBest;
 
             float delta = cost1 - cost0;
-            if (delta > 0 || (std::exp(delta/temp) > frand())) {
+            if (delta > 0 || (std::exp(delta/temp) > params.rng.frand())) {
                 cost0 = cost1;
+                commitScoreUpdate(helpers);
             } else {
-                clMap = clMapSave;
+                clArray = clArraySave;
             }
 
             temp *= params.coolingRate;
         }
 
+        clMap = toClusterToLetterMap(clArray);
+
         for (auto & cl : clMap) {
             printf("%d - %c\n", cl.first, 'a' + cl.second - 1);
         }
@@ -1110,7 +1687,7 @@ namespace Cipher {
     }
 
     bool doSimulatedAnnealing5(
-        const TParameters & params,
+        TParameters & params,
         const TFreqMap & freqMap,
         const TSimilarityMap & ccMap,
         TClusters & clusters,
@@ -1119,6 +1696,11 @@ namespace Cipher {
 
         int n = clusters.size();
 
+        // the arrays below are indexed by cluster id - the clusters come from the caller (e.g. a loaded checkpoint)
+        for (const auto & cid : clusters) {
+            assert(cid >= 0 && cid < params.maxClusters);
+        }
+
         int ncc = 0;
         float ccavg = 0.0;
         for (int j = 0; j < n; ++j) {
@@ -1130,15 +1712,15 @@ namespace Cipher {
         ccavg /= ncc;
         printf("Average cc = %g\n", ccavg);
 
-        clMap.clear();
+        TClusterToLetterArray clArray(params.maxClusters, 0);
         std::map<TLetter, bool> used;
-        std::map<TClusterId, bool> fixed;
+        std::vector<bool> fixed(params.maxClusters, false);
         for (int i = 0; i < (int) params.hint.size(); ++i) {
             if (params.hint[i] < 0) continue;
             //if (used[params.hint[i]]) continue;
             if (fixed[clusters[i]]) continue;
 
-            clMap[clusters[i]] = params.hint[i];
+            clArray[clusters[i]] = params.hint[i];
             used[params.hint[i]] = true;
             fixed[clusters[i]] = true;
             printf("Fixed %d\n", clusters[i]);
@@ -1149,14 +1731,25 @@ namespace Cipher {
             for (int i = 0; i < params.maxClusters; ++i) {
                 if (fixed[i]) continue;
                 while (used[ii]) ++ii;
-                clMap[i] = ii++;
+                clArray[i] = ii++;
             }
         }
 
+        TClusterPos clusterPos(params.maxClusters);
+        for (int i = 0; i < n; ++i) {
+            clusterPos[clusters[i]].push_back(i);
+        }
+
+        // the clusters changed in the current iteration
+        std::vector<TClusterId> changedClusters;
+
+        TScoreHelpers helpers;
+        calcScoreHelpers(params, freqMap, clusters, clArray, helpers);
+
         float wlm = params.wLanguageModel;
         float temp = params.temp0;
         float cost0CL = costF(ccMap, clusters);
-        float cost0LM = calcScore0(params, freqMap, clusters, clMap);
+        float cost0LM = calcScore2(params, freqMap, helpers.counts, n);
         float cost0 = cost0CL + wlm*cost0LM;
 
         int nRepeat = 0;
@@ -1166,12 +1759,15 @@ namespace Cipher {
 
         for (int iter = 0; iter < params.saMaxIterations; ++iter) {
             if (iter%10000 == 0) {
+                // discard the rounding errors accumulated by the incremental updates
+                calcScoreHelpers(params, freqMap, clusters, clArray, helpers);
+
                 auto tEnd = std::chrono::high_resolution_clock::now();
                 float iterPerT = (float)(iter)/((float)(std::chrono::duration_cast<std::chrono::milliseconds>(tEnd - tStart).count()));
 
                 printf("Speed: %6.2f iter/ms, Iter %5d : temp = %16.4f, cost0 = %8.4f, costCL = %8.4f, costLM = %8.4f\n",
                        iterPerT, iter, temp, cost0, cost0CL, cost0LM);
-                for (int i = 0; i < (int) clusters.size(); ++i) { printf("%c", 'a'+clMap[clusters[i]]-1); }
+                for (int i = 0; i < (int) clusters.size(); ++i) { printf("%c", 'a'+clArray[clusters[i]]-1); }
                 printf("\n");
             }
 
@@ -1191,31 +1787,40 @@ namespace Cipher {
 
             int cid = -1;
             int i1l = -1;
-            int i = rand()%n;
-            int i1 = rand()%params.maxClusters;
-            int i2 = rand()%params.maxClusters;
-            int i3 = rand()%params.maxClusters;
+            int i = params.rng.uniform(n);
+            int i1 = params.rng.uniform(params.maxClusters);
+            int i2 = params.rng.uniform(params.maxClusters);
+            int i3 = params.rng.uniform(params.maxClusters);
 
             float costCurCL = cost0CL;
             float costCurLM = cost0LM;
 
             {
                 while (params.hint[i] >= 0) {
-                    i = rand()%n;
+                    i = params.rng.uniform(n);
                 }
 
                 cid = clusters[i];
                 while (cid == clusters[i]) {
-                    clusters[i] = rand()%params.maxClusters;
+                    clusters[i] = params.rng.uniform(params.maxClusters);
                 }
 
                 costCurCL = costFUpdate(ccMap, clusters, i, cid, cost0CL);
 
                 float cost1 = costCurCL + wlm*cost0LM;
                 float delta = cost1 - cost0;
-                if (delta > 0 || (std::exp(0.01f*(delta/temp)) > frand())) {
+                if (delta > 0 || (std::exp(0.01f*(delta/temp)) > params.rng.frand())) {
                     cost0CL = costCurCL;
                     cost0 = cost1;
+
+                    auto & posOld = clusterPos[cid];
+                    auto & posNew = clusterPos[clusters[i]];
+                    posOld.erase(std::lower_bound(posOld.begin(), posOld.end(), i));
+                    posNew.insert(std::lower_bound(posNew.begin(), posNew.end(), i), i);
+
+                    changedClusters.assign(1, clusters[i]);
+                    calcScoreUpdate(params, freqMap, clusters, clArray, clusterPos, changedClusters, helpers);
+                    commitScoreUpdate(helpers);
                 } else {
                     clusters[i] = cid;
                 }
@@ -1223,50 +1828,59 @@ namespace Cipher {
 
             {
                 while (i2 == i3 || fixed[i2] || fixed[i3]) {
-                    i2 = rand()%params.maxClusters;
-                    i3 = rand()%params.maxClusters;
+                    i2 = params.rng.uniform(params.maxClusters);
+                    i3 = params.rng.uniform(params.maxClusters);
                 }
-                std::swap(clMap[i2], clMap[i3]);
+                std::swap(clArray[i2], clArray[i3]);
 
                 while (fixed[i1]) {
-                    i1 = rand()%params.maxClusters;
+                    i1 = params.rng.uniform(params.maxClusters);
                 }
-                i1l = clMap[i1];
-                int letterNew = rand()%27;
-                while (clMap[i1] == letterNew) {
-                    letterNew = rand()%27;
+                i1l = clArray[i1];
+                int letterNew = params.rng.uniform(27);
+                while (clArray[i1] == letterNew) {
+                    letterNew = params.rng.uniform(27);
                 }
 
-                clMap[i1] = letterNew;
+                clArray[i1] = letterNew;
 
-                costCurLM = calcScore0(params, freqMap, clusters, clMap);
+                changedClusters.assign({ i1, i2, i3 });
+                costCurLM = calcScoreUpdate(params, freqMap, clusters, clArray, clusterPos, changedClusters, helpers);
 
                 float cost1 = cost0CL + wlm*costCurLM;
                 float delta = cost1 - cost0;
-                if (delta > 0 || (std::exp(0.01f*(delta/temp)) > frand())) {
+                if (delta > 0 || (std::exp(0.01f*(delta/temp)) > params.rng.frand())) {
                     cost0LM = costCurLM;
                     cost0 = cost1;
+                    commitScoreUpdate(helpers);
                 } else {
-                    clMap[i1] = i1l;
-                    std::swap(clMap[i2], clMap[i3]);
+                    clArray[i1] = i1l;
+                    std::swap(clArray[i2], clArray[i3]);
                 }
             }
 
             temp *= params.coolingRate;
         }
 
+        clMap = toClusterToLetterMap(clArray);
+
         return true;
     }
 
     void getRandomCLMap(
-        const TParameters & params,
+        TParameters & params,
         const TClusters & clusters,
-        TClusterToLetterMap & clMap) {
+        TClusterToLetterArray & clMap) {
 
-        clMap.clear();
+        // the arrays below are indexed by cluster id - the clusters come from the caller (e.g. a loaded checkpoint)
+        for (const auto & cid : clusters) {
+            assert(cid >= 0 && cid < params.maxClusters);
+        }
+
+        clMap.resize(params.maxClusters);
 
         for (int i = 0; i < params.maxClusters; ++i) {
-            clMap[i] = rand()%27;
+            clMap[i] = params.rng.uniform(27);
         }
 
         std::map<int, std::vector<int>> options;
@@ -1277,25 +1891,25 @@ namespace Cipher {
 
         for (auto & option : options) {
             int n = option.second.size();
-            clMap[option.first] = option.second[rand()%n];
+            clMap[option.first] = option.second[params.rng.uniform(n)];
         }
     }
 
     bool subbreak(
-        const TParameters & params,
+        TParameters & params,
         const TFreqMap & freqMap,
         TResult & result) {
         const auto & clusters = result.clusters;
         auto & clMap = result.clMap;
         auto & minBestP = result.p;
 
-        std::map<TLetter, bool> fixed;
+        std::vector<bool> fixed(params.maxClusters, false);
         for (int i = 0; i < (int) params.hint.size(); ++i) {
             if (params.hint[i] < 0) continue;
             fixed[clusters[i]] = true;
         }
 
-        auto besta = clMap;
+        TClusterToLetterArray besta;
         getRandomCLMap(params, clusters, besta);
         float bestp = calcScore0(params, freqMap, clusters, besta);
 
@@ -1312,11 +1926,11 @@ namespace Cipher {
 
             int nswaps = 3;
             for (int i = 0; i < nswaps; ++i) {
-                int a0 = rand()%params.maxClusters;
-                int a1 = rand()%params.maxClusters;
+                int a0 = params.rng.uniform(params.maxClusters);
+                int a1 = params.rng.uniform(params.maxClusters);
                 while (a0 == a1 || fixed[a0] || fixed[a1]) {
-                    a0 = rand()%params.maxClusters;
-                    a1 = rand()%params.maxClusters;
+                    a0 = params.rng.uniform(params.maxClusters);
+                    a1 = params.rng.uniform(params.maxClusters);
                 }
 
                 std::swap(itera[a0], itera[a1]);
@@ -1325,11 +1939,11 @@ namespace Cipher {
             auto iterp = calcScore0(params, freqMap, clusters, itera);
             auto cura = itera;
             for (int i = 0; i < 5; ++i) {
-                int a0 = rand()%params.maxClusters;
-                int a1 = rand()%params.maxClusters;
+                int a0 = params.rng.uniform(params.maxClusters);
+                int a1 = params.rng.uniform(params.maxClusters);
                 while (a0 == a1 || fixed[a0] || fixed[a1]) {
-                    a0 = rand()%params.maxClusters;
-                    a1 = rand()%params.maxClusters;
+                    a0 = params.rng.uniform(params.maxClusters);
+                    a1 = params.rng.uniform(params.maxClusters);
                 }
 
                 std::swap(cura[a0], cura[a1]);
@@ -1350,7 +1964,7 @@ namespace Cipher {
 
                 if (bestp > minBestP) {
                     minBestP = bestp;
-                    clMap = besta;
+                    clMap = toClusterToLetterMap(besta);
                 }
                 nIters = 0;
             }
@@ -1360,7 +1974,7 @@ namespace Cipher {
     }
 
     bool subbreak1(
-        const TParameters & params,
+        TParameters & params,
         const TFreqMap & freqMap,
         TResult & result) {
 
@@ -1377,10 +1991,10 @@ namespace Cipher {
         auto & clMap = result.clMap;
         auto & minBestP = result.p;
 
-        auto besta = clMap;
+        TClusterToLetterArray besta;
         getRandomCLMap(params, clusters, besta);
 
-        std::map<TLetter, bool> fixed;
+        std::vector<bool> fixed(params.maxClusters, false);
         for (int i = 0; i < (int) params.hint.size(); ++i) {
             if (params.hint[i] < 0) continue;
             fixed[clusters[i]] = true;
@@ -1405,11 +2019,11 @@ namespace Cipher {
 
             int nswaps = 3;
             for (int i = 0; i < nswaps; ++i) {
-                int a0 = rand()%params.maxClusters;
-                int a1 = rand()%params.maxClusters;
+                int a0 = params.rng.uniform(params.maxClusters);
+                int a1 = params.rng.uniform(params.maxClusters);
                 while (a0 == a1) {
-                    a0 = rand()%params.maxClusters;
-                    a1 = rand()%params.maxClusters;
+                    a0 = params.rng.uniform(params.maxClusters);
+                    a1 = params.rng.uniform(params.maxClusters);
                 }
 
                 if (fixed[a0] || fixed[a1]) {
@@ -1423,11 +2037,11 @@ namespace Cipher {
 
             auto cura = itera;
             for (int i = 0; i < 10; ++i) {
-                int a0 = rand()%params.maxClusters;
-                int a1 = rand()%params.maxClusters;
+                int a0 = params.rng.uniform(params.maxClusters);
+                int a1 = params.rng.uniform(params.maxClusters);
                 while (a0 == a1) {
-                    a0 = rand()%params.maxClusters;
-                    a1 = rand()%params.maxClusters;
+                    a0 = params.rng.uniform(params.maxClusters);
+                    a1 = params.rng.uniform(params.maxClusters);
                 }
 
                 //std::swap(cura[a0], cura[a1]);
@@ -1450,7 +2064,7 @@ namespace Cipher {
 
                 if (bestp > minBestP) {
                     minBestP = bestp;
-                    clMap = besta;
+                    clMap = toClusterToLetterMap(besta);
                 }
                 nIters = 0;
             }
@@ -1539,7 +2153,7 @@ namespace Cipher {
         return true;
     }
 
-    bool mutateClusters(const TParameters & params, TClusters & clusters) {
+    bool mutateClusters(TParameters & params, TClusters & clusters) {
         int n = clusters.size();
 
         //for (int i = 0; i < 3; ++i) {
@@ -1549,8 +2163,8 @@ namespace Cipher {
         //}
 
         for (int i = 0; i < 1; ++i) {
-            int idx = rand()%n;
-            clusters[idx] = rand()%params.maxClusters;
+            int idx = params.rng.uniform(n);
+            clusters[idx] = params.rng.uniform(params.maxClusters);
             //auto p = clusters[idx];
             //while (clusters[idx] == p) {
             //    clusters[idx] = rand()%params.maxClusters;
@@ -1700,6 +2314,19 @@ namespace Cipher {
     // Processor
     //
 
+    namespace {
+        // the model is identified by its n-gram length, total count and pmin - hashing all probabilities on each init
+        // would be too slow for the large models
+        uint64_t calcFingerprint(const TFreqMap & freqMap, const TSimilarityMap & similarityMap) {
+            uint64_t h = calcHash(similarityMap);
+            h = calcHash(&freqMap.len, sizeof(freqMap.len), h);
+            h = calcHash(&freqMap.nTotal, sizeof(freqMap.nTotal), h);
+            h = calcHash(&freqMap.pmin, sizeof(freqMap.pmin), h);
+
+            return h;
+        }
+    }
+
     Processor::Processor() {
     }
 
@@ -1710,6 +2337,7 @@ namespace Cipher {
         m_params = params;
         m_freqMap = &freqMap;
         m_similarityMap = similarityMap;
+        m_fingerprint = calcFingerprint(freqMap, similarityMap);
 
         normalizeSimilarityMap(m_params, m_similarityMap, m_logMap, m_logMapInv);
         generateClustersInitialGuess(m_params, m_similarityMap, m_curResult.clusters);
@@ -1737,6 +2365,12 @@ namespace Cipher {
     }
 
     bool Processor::setHint(const THint & hint) {
+        // the hinted positions index the current clustering
+        assert(hint.size() <= m_curResult.clusters.size());
+        for (int i = 0; i < (int) hint.size(); ++i) {
+            assert(hint[i] < 0 || (m_curResult.clusters[i] >= 0 && m_curResult.clusters[i] < m_params.maxClusters));
+        }
+
         m_params.hint = hint;
 
         return true;
@@ -1750,7 +2384,7 @@ namespace Cipher {
             Cipher::mutateClusters(m_params, clustersNew);
             auto pNew = calcPClusters(m_params, m_similarityMap, m_logMap, m_logMapInv, clustersNew, m_curResult.clMap);
 
-            auto u = frand();
+            auto u = m_params.rng.frand();
             //auto alpha = pNew/pCur;
             auto alpha = pNew > m_pCur ? 1.0 : std::exp((pNew - m_pCur));
 
@@ -1765,7 +2399,7 @@ namespace Cipher {
                     auto saveHint = m_params.hint;
                     for (auto & hint : m_params.hint) {
                         if (hint < 0) continue;
-                        if (frand() > 0.10) {
+                        if (m_params.rng.frand() > 0.10) {
                             hint = -1;
                         }
                     }
@@ -1794,4 +2428,203 @@ namespace Cipher {
         return m_similarityMap;
     }
 
+    //
+    // Checkpoints
+    //
+
+    static constexpr uint32_t kStateMagic = 0x3250544b; // "KTP2"
+    static constexpr int32_t kStateVersion = 2;
+
+    bool Processor::saveState(std::ostream & out) const {
+        writeValue(out, kStateMagic);
+        writeValue(out, kStateVersion);
+        writeValue(out, m_fingerprint);
+
+        writeValue(out, m_params.minClusters);
+        writeValue(out, m_params.maxClusters);
+        writeValue(out, m_params.nIterationsPerUpdate);
+        writeValue(out, m_params.nChangePerIteration);
+        writeValue(out, m_params.saMaxIterations);
+        writeValue(out, m_params.temp0);
+        writeValue(out, m_params.coolingRate);
+        writeValue(out, m_params.nSubbreakIterations);
+        writeValue(out, m_params.pNonAlphabetic);
+        writeValue(out, m_params.nMHInitialIters);
+        writeValue(out, m_params.nMHIters);
+        writeValue(out, m_params.includeSpaces);
+        writeValue(out, m_params.wEnglishFreq);
+        writeValue(out, m_params.wLanguageModel);
+        writeValue(out, m_params.waveformDeviationMin);
+        writeValue(out, m_params.waveformDeviationSig);
+        writeValue(out, m_params.waveformDetectionErrorP);
+        writeValue(out, m_params.waveformDetectionErrorMin);
+        writeValue(out, m_params.waveformDetectionErrorSig);
+        writeValue(out, m_params.similarityNoiseSig);
+        writeValue(out, m_params.similarityMismatchAvg);
+        writeValue(out, m_params.similarityMismatchSig);
+        writeVector(out, m_params.hint);
+        writeValue(out, m_params.rng.s);
+
+        writeValue(out, m_nMHInitialIters);
+
+        writeValue(out, m_curResult.id);
+        writeValue(out, m_curResult.p);
+        {
+            const int32_t n = m_curResult.clMap.size();
+            writeValue(out, n);
+            for (const auto & kv : m_curResult.clMap) {
+                writeValue(out, kv.first);
+                writeValue(out, kv.second);
+            }
+        }
+        writeVector(out, m_curResult.clusters);
+
+        return out.good();
+    }
+
+    bool Processor::loadState(std::istream & in) {
+        uint32_t magic = 0;
+        int32_t version = 0;
+        if (readValue(in, magic) == false || magic != kStateMagic) {
+            printf("    Invalid processor state\n");
+            return false;
+        }
+        if (readValue(in, version) == false || version != kStateVersion) {
+            printf("    Unsupported processor state version %d\n", version);
+            return false;
+        }
+
+        uint64_t fingerprint = 0;
+        if (readValue(in, fingerprint) == false || fingerprint != m_fingerprint) {
+            printf("    Processor state is for a different model or similarity map\n");
+            return false;
+        }
+
+        const int32_t n = m_similarityMap.size();
+
+        auto params = m_params;
+        int nMHInitialIters = 0;
+        TResult result;
+
+        bool ok = true;
+        ok = ok && readValue(in, params.minClusters);
+        ok = ok && readValue(in, params.maxClusters);
+        ok = ok && readValue(in, params.nIterationsPerUpdate);
+        ok = ok && readValue(in, params.nChangePerIteration);
+        ok = ok && readValue(in, params.saMaxIterations);
+        ok = ok && readValue(in, params.temp0);
+        ok = ok && readValue(in, params.coolingRate);
+        ok = ok && readValue(in, params.nSubbreakIterations);
+        ok = ok && readValue(in, params.pNonAlphabetic);
+        ok = ok && readValue(in, params.nMHInitialIters);
+        ok = ok && readValue(in, params.nMHIters);
+        ok = ok && readValue(in, params.includeSpaces);
+        ok = ok && readValue(in, params.wEnglishFreq);
+        ok = ok && readValue(in, params.wLanguageModel);
+        ok = ok && readValue(in, params.waveformDeviationMin);
+        ok = ok && readValue(in, params.waveformDeviationSig);
+        ok = ok && readValue(in, params.waveformDetectionErrorP);
+        ok = ok && readValue(in, params.waveformDetectionErrorMin);
+        ok = ok && readValue(in, params.waveformDetectionErrorSig);
+        ok = ok && readValue(in, params.similarityNoiseSig);
+        ok = ok && readValue(in, params.similarityMismatchAvg);
+        ok = ok && readValue(in, params.similarityMismatchSig);
+        ok = ok && readVector(in, params.hint, n);
+        ok = ok && readValue(in, params.rng.s);
+
+        ok = ok && readValue(in, nMHInitialIters);
+
+        ok = ok && readValue(in, result.id);
+        ok = ok && readValue(in, result.p);
+        {
+            int32_t nMap = 0;
+            ok = ok && readValue(in, nMap) && nMap >= 0 && nMap <= params.maxClusters;
+            for (int i = 0; ok && i < nMap; ++i) {
+                TClusterId cid = 0;
+                TLetter letter = 0;
+                ok = ok && readValue(in, cid) && readValue(in, letter);
+                result.clMap[cid] = letter;
+            }
+        }
+        ok = ok && readVector(in, result.clusters, n);
+
+        if (ok == false) {
+            printf("    Truncated or corrupted processor state\n");
+            return false;
+        }
+
+        if ((int) result.clusters.size() != n) {
+            printf("    Processor state is for %d key presses, but the similarity map has %d\n", (int) result.clusters.size(), n);
+            return false;
+        }
+
+        if (params.minClusters < 1 || params.maxClusters < params.minClusters ||
+            isValidClustering(result.clusters, result.clMap, params.hint, params.maxClusters) == false) {
+            printf("    Processor state has out of range cluster ids or letters\n");
+            return false;
+        }
+
+        m_params = std::move(params);
+        m_nMHInitialIters = nMHInitialIters;
+        m_curResult = std::move(result);
+
+        // the score of the loaded clustering is not trusted from the file
+        m_pCur = calcPClusters(m_params, m_similarityMap, m_logMap, m_logMapInv, m_curResult.clusters, m_curResult.clMap);
+
+        return true;
+    }
+
+    bool saveProcessors(const char * fname, const std::map<int, Processor> & processors) {
+        return saveFileAtomic(fname, [&](std::ostream & out) {
+            const int32_t n = processors.size();
+            writeValue(out, n);
+            for (const auto & kv : processors) {
+                const int32_t id = kv.first;
+                writeValue(out, id);
+                if (kv.second.saveState(out) == false) {
+                    return false;
+                }
+            }
+
+            return out.good();
+        });
+    }
+
+    bool loadProcessors(const char * fname, std::map<int, Processor> & processors) {
+        std::ifstream fin(fname, std::ios::binary);
+        if (fin.good() == false) {
+            printf("    Failed to open file '%s'\n", fname);
+            return false;
+        }
+
+        int32_t n = 0;
+        if (readValue(fin, n) == false || n != (int) processors.size()) {
+            printf("    Checkpoint '%s' has %d processors, expected %d\n", fname, n, (int) processors.size());
+            return false;
+        }
+
+        // all or nothing
+        auto res = processors;
+        std::set<int32_t> loaded;
+        for (int i = 0; i < n; ++i) {
+            int32_t id = -1;
+            if (readValue(fin, id) == false || res.count(id) == 0) {
+                printf("    Checkpoint '%s' has unknown processor %d\n", fname, id);
+                return false;
+            }
+            if (loaded.insert(id).second == false) {
+                printf("    Checkpoint '%s' has processor %d more than once\n", fname, id);
+                return false;
+            }
+            if (res[id].loadState(fin) == false) {
+                printf("    Failed to load processor %d from '%s'\n", id, fname);
+                return false;
+            }
+        }
+
+        processors = std::move(res);
+
+        return true;
+    }
+
 }
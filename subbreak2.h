@@ -11,6 +11,8 @@
 #include <cmath>
 #include <vector>
 #include <string>
+#include <cstring>
+#include <algorithm>
 
 namespace Cipher {
 
@@ -23,6 +25,10 @@ namespace Cipher {
     using TClusterCount = std::vector<int>;
     using TClusterPos = std::vector<std::vector<int>>;
 
+    // flat form of TClusterToLetterMap - element cid is the letter of cluster cid
+    // used by the scoring hot loops, while the map is used at the API boundary
+    using TClusterToLetterArray = std::vector<TLetter>;
+
     struct TParameters {
         // clustering params
         int minClusters = 23;
@@ -59,13 +65,85 @@ namespace Cipher {
         float similarityMismatchSig = 0.2f;
 
         THint hint = {};
+
+        // used by all stochastic steps - seed with rng.seed(x) for reproducible runs
+        TRandom rng;
     };
 
+    // largest n-gram model that loadFreqMap keeps as a dense table of doubles (TFreqMap::Auto)
+    constexpr int64_t kFreqMapMaxDenseSize_MB = 64;
+
     struct TFreqMap {
+        // how the n-gram log-probabilities are stored - selected in loadFreqMap
+        enum EStorage {
+            Auto,       // picked by loadFreqMap from the size of the model
+            Dense,      // prob - a double for every code
+            DenseF32,   // probF32 - a float for every code
+            DenseF16,   // probF16 - an IEEE half for every code
+            Sparse,     // sparse - only the n-grams in the model, sorted by code; the rest have probability pmin
+            Quantized,  // 8 or 16 bit indices into the codebook for every code (see quantizeFreqMap)
+        };
+
+        struct TSparseEntry {
+            TCode code;
+            float prob;
+        };
+
         TGramLen len = -1;
         TProb pmin = 0.0;
         int64_t nTotal = 0;
+        EStorage storage = Dense;
+
+        // the absolute error of each stored log10 probability is at most maxQuantError
+        double maxQuantError = 0.0;
+
         std::vector<TProb> prob;
+        std::vector<float> probF32;
+        std::vector<uint16_t> probF16;
+
+        // sparse[sparseOffsets[b]] .. sparse[sparseOffsets[b + 1] - 1] are the n-grams with code >> sparseShift == b
+        int32_t sparseShift = 0;
+        std::vector<uint32_t> sparseOffsets;
+        std::vector<TSparseEntry> sparse;
+
+        int32_t nQuantBits = 0;
+        std::vector<TProb> codebook;
+        std::vector<uint8_t> probQ8;
+        std::vector<uint16_t> probQ16;
+
+        // the log-probabilities are far from the limits of the half format, so only normal numbers and zero are handled
+        static inline float halfToFloat(uint16_t h) {
+            if ((h & 0x7fff) == 0) return 0.0f;
+
+            const uint32_t x = (((uint32_t) (h & 0x8000)) << 16) | ((((uint32_t) (h >> 10) & 0x1f) + 112) << 23) | (((uint32_t) (h & 0x3ff)) << 13);
+
+            float res;
+            std::memcpy(&res, &x, sizeof(res));
+            return res;
+        }
+
+        inline TProb get(TCode code) const {
+            switch (storage) {
+                case DenseF32:
+                    return probF32[code];
+                case DenseF16:
+                    return halfToFloat(probF16[code]);
+                case Sparse:
+                    {
+                        const auto b = ((uint32_t) code) >> sparseShift;
+                        const auto first = sparse.begin() + sparseOffsets[b];
+                        const auto last = sparse.begin() + sparseOffsets[b + 1];
+                        for (auto it = first; it != last; ++it) {
+                            if (it->code >= code) return it->code == code ? it->prob : pmin;
+                        }
+                        return pmin;
+                    }
+                case Quantized:
+                    return codebook[nQuantBits == 8 ? probQ8[code] : probQ16[code]];
+                default:
+                    return prob[code];
+            }
+        }
     };
 
     struct TResult {
@@ -76,10 +154,20 @@ namespace Cipher {
     };
 
     TCode calcCode(const char * data, int n);
-    bool loadFreqMap(const char * fname, TFreqMap & res);
 
-    bool encryptExact(const TParameters & params, const std::string & text, TClusters & clusters);
-    bool generateSimilarityMap(const TParameters & params, const std::string & text, TSimilarityMap & ccMap);
+    TClusterToLetterMap toClusterToLetterMap(const TClusterToLetterArray & clArray);
+
+    // with storage == Auto, the model is kept as Dense if the table fits in kFreqMapMaxDenseSize_MB, otherwise as
+    // 16-bit Quantized, or as Sparse if that is at least 4 times smaller. the dense table of doubles is allocated
+    // only for the Dense storage
+    bool loadFreqMap(const char * fname, TFreqMap & res, TFreqMap::EStorage storage = TFreqMap::Auto);
+
+    // replaces the stored log-probabilities (in any storage, including an already quantized one) with nQuantBits
+    // (8 or 16) bit codebook indices. the absolute error of each log10 probability is at most res.maxQuantError
+    bool quantizeFreqMap(TFreqMap & res, int nQuantBits);
+
+    bool encryptExact(TParameters & params, const std::string & text, TClusters & clusters);
+    bool generateSimilarityMap(TParameters & params, const std::string & text, TSimilarityMap & ccMap);
 
     bool generateClusters(const TParameters & params, int n, TClusters & clusters);
     bool printClusterGoodness(const std::string & text, const TClusters & clusters);
@@ -88,30 +176,30 @@ namespace Cipher {
     float costFUpdate(const TSimilarityMap & ccMap, const TClusters & clusters, int i, int cid, float c0);
 
     bool doSimulatedAnnealing3(
-            const TParameters & params,
+            TParameters & params,
             const TSimilarityMap & ccMap,
             TClusters & clusters);
 
     bool doSimulatedAnnealing4(
-            const TParameters & params,
+            TParameters & params,
             const TFreqMap & freqMap,
             const TClusters & clusters,
             TClusterToLetterMap & clMap);
 
     bool doSimulatedAnnealing5(
-            const TParameters & params,
+            TParameters & params,
             const TFreqMap & freqMap,
             const TSimilarityMap & ccMap,
             TClusters & clusters,
             TClusterToLetterMap & clMap);
 
     bool subbreak(
-            const TParameters & params,
+            TParameters & params,
             const TFreqMap & freqMap,
             TResult & result);
 
     bool subbreak1(
-            const TParameters & params,
+            TParameters & params,
             const TFreqMap & freqMap,
             TResult & result);
 
@@ -120,7 +208,11 @@ namespace Cipher {
             const TSimilarityMap & ccMap,
             TClusters & clusters);
 
-    bool mutateClusters(const TParameters & params, TClusters & clusters);
+    bool mutateClusters(TParameters & params, TClusters & clusters);
+
+    // consistency check of the incremental scoring used by the annealing loops: applies nUpdates random changes
+    // of a random cluster-to-letter map and returns the largest difference between the incremental and the full score
+    double checkScoreUpdate(TParameters & params, const TFreqMap & freqMap, const TClusters & clusters, int nUpdates);
 
     double calcPClusters(
             const TParameters & ,
@@ -158,6 +250,12 @@ namespace Cipher {
         const TResult & getResult() const;
         const TSimilarityMap & getSimilarityMap() const;
 
+        // binary snapshot of the search - the parameters (including the RNG state), the current result and the counters
+        // the model and the similarity map are not part of it, only their fingerprint - loading fails unless the Processor
+        // has been init()-ed with the same ones. on failure, the Processor is left unchanged
+        bool saveState(std::ostream & out) const;
+        bool loadState(std::istream & in);
+
     private:
         TParameters m_params;
         const TFreqMap* m_freqMap = nullptr;
@@ -169,5 +267,15 @@ namespace Cipher {
         double m_pCur = 0.0f;
 
         TResult m_curResult;
+
+        // identifies the model and the similarity map the Processor was init()-ed with
+        uint64_t m_fingerprint = 0;
     };
+
+    // checkpoint with the states of all processors, written with saveFileAtomic
+    bool saveProcessors(const char * fname, const std::map<int, Processor> & processors);
+
+    // resumes the processors from a checkpoint - they must be init()-ed with the same ids, model and similarity map
+    // on failure, none of the processors is changed
+    bool loadProcessors(const char * fname, std::map<int, Processor> & processors);
 }
@@ -11,7 +11,25 @@
 #include <fstream>
 #include <chrono>
 #include <cassert>
+#include <cstring>
+#include <cstdio>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <thread>
+#include <set>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <dirent.h>
+#include <cerrno>
+#endif
 
 namespace {
 
@@ -306,13 +324,13 @@ namespace {
     };
 
 template <typename T>
-void shuffle(T & t, int start = -1, int end = -1, const Cipher::THint & hint = {}) {
+void shuffle(TRandom & rng, T & t, int start = -1, int end = -1, const Cipher::THint & hint = {}) {
     if (start == -1) start = 0;
     if (end == -1) end = t.size();
 
     for (int i = end - 1; i > start; --i) {
         int i0 = i;
-        int i1 = rand()%(i - start + 1)+start;
+        int i1 = rng.uniform(i - start + 1) + start;
         if (hint.size() > 0 && (hint[i0] != -1 || hint[i1] != -1)) {
             continue;
         }
@@ -320,6 +338,649 @@ void shuffle(T & t, int start = -1, int end = -1, const Cipher::THint & hint = {
     }
 }
 
+// Zobrist key of a (cluster, letter) pair
+uint64_t getZobristKey(TClusterId cid, TLetter a) {
+    uint64_t x = (((uint64_t) cid) << 8) + a + 1;
+    x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27))*0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// set of 64-bit hashes with open addressing, reused between the beam search layers
+struct THashSet64 {
+    int32_t nBits = 0;
+    std::vector<uint64_t> data;
+
+    void reset(int64_t n) {
+        nBits = 1;
+        while ((1ll << nBits) < 2*n) ++nBits;
+        data.assign(1ull << nBits, 0);
+    }
+
+    // returns false if the hash is already in the set
+    bool insert(uint64_t h) {
+        if (h == 0) h = 1; // 0 marks the empty slots
+
+        const uint64_t mask = (1ull << nBits) - 1;
+        uint64_t i = (h*0x9e3779b97f4a7c15ull) >> (64 - nBits);
+        while (data[i] != 0) {
+            if (data[i] == h) return false;
+            i = (i + 1) & mask;
+        }
+        data[i] = h;
+
+        return true;
+    }
+};
+
+struct TGramCount {
+    Cipher::TCode code;
+    int64_t count;
+};
+
+// sorted and reduced partial result of the wildcard expansion, kept in memory or spilled to a temporary file
+struct TGramCountRun {
+    std::vector<TGramCount> data;
+    FILE * file = nullptr;
+    int64_t n = 0;
+};
+
+// sum the counts of all n-grams that match each wildcard mask (masked letters become 0)
+// the masks are processed in parallel - each one produces a sorted run with unique codes and the runs are combined
+// with a k-way merge, which passes each (code, count) to cbCount in increasing order of the codes
+// memoryBudget_bytes bounds the scratch buffers of the workers (2 x grams per thread - the number of threads is
+// reduced to fit), the runs kept in memory and the read buffers of the merge. the rest of the runs are spilled to disk
+template <typename TCallback>
+bool calcWildcardCounts(
+        const std::vector<int32_t> & masks,
+        const std::vector<TGramCount> & grams,
+        int nThreads,
+        int64_t memoryBudget_bytes,
+        TCallback && cbCount) {
+    const int nMasks = masks.size();
+    const int64_t nGrams = grams.size();
+
+    const int64_t scratchPerThread_bytes = 2*nGrams*sizeof(TGramCount);
+
+    nThreads = std::max(1, std::min(nThreads, nMasks));
+    if (memoryBudget_bytes >= 0) {
+        nThreads = std::max<int64_t>(1, std::min<int64_t>(nThreads, memoryBudget_bytes/std::max<int64_t>(1, scratchPerThread_bytes)));
+        if (memoryBudget_bytes < scratchPerThread_bytes) {
+            printf("    Warning: memory budget %g MB is below the %g MB needed by a single worker\n",
+                   (double) memoryBudget_bytes/1024.0/1024.0, (double) scratchPerThread_bytes/1024.0/1024.0);
+        }
+    }
+
+    std::vector<TGramCountRun> runs(nMasks);
+
+    {
+        std::mutex mutex;
+        std::atomic<int> iNext(0);
+        int64_t memoryUsed_bytes = nThreads*scratchPerThread_bytes;
+        int64_t memoryRuns_bytes = 0;
+        bool failed = false;
+
+        auto worker = [&]() {
+            std::vector<TGramCount> buf;
+            std::vector<TGramCount> tmp;
+            while (true) {
+                const int im = iNext++;
+                if (im >= nMasks) break;
+
+                const auto mask = masks[im];
+
+                buf.resize(nGrams);
+                for (int64_t i = 0; i < nGrams; ++i) {
+                    buf[i] = { grams[i].code & mask, grams[i].count };
+                }
+
+                // LSD radix sort by code - the codes are non-negative and at most 5*len bits long
+                {
+                    static const int kRadixBits = 11;
+                    std::vector<int64_t> offsets(1 << kRadixBits);
+                    tmp.resize(nGrams);
+                    for (int shift = 0; (mask >> shift) != 0; shift += kRadixBits) {
+                        std::fill(offsets.begin(), offsets.end(), 0);
+                        for (int64_t i = 0; i < nGrams; ++i) {
+                            ++offsets[(buf[i].code >> shift) & ((1 << kRadixBits) - 1)];
+                        }
+                        int64_t sum = 0;
+                        for (auto & o : offsets) {
+                            const auto cnt = o;
+                            o = sum;
+                            sum += cnt;
+                        }
+                        for (int64_t i = 0; i < nGrams; ++i) {
+                            tmp[offsets[(buf[i].code >> shift) & ((1 << kRadixBits) - 1)]++] = buf[i];
+                        }
+                        std::swap(buf, tmp);
+                    }
+                }
+
+                int64_t n = 0;
+                for (int64_t i = 0; i < nGrams; ++i) {
+                    if (n > 0 && buf[n - 1].code == buf[i].code) {
+                        buf[n - 1].count += buf[i].count;
+                    } else {
+                        buf[n++] = buf[i];
+                    }
+                }
+                buf.resize(n);
+
+                auto & run = runs[im];
+                run.n = n;
+
+                // a run that fills most of the buffer takes it over, a small one is copied, so the buffer is reused
+                const bool move = 2*n >= nGrams;
+                const int64_t size_bytes = (move ? (int64_t) buf.capacity() : n)*sizeof(TGramCount);
+
+                bool spill = false;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (memoryBudget_bytes >= 0 && memoryUsed_bytes + size_bytes > memoryBudget_bytes) {
+                        spill = true;
+                    } else {
+                        memoryUsed_bytes += size_bytes;
+                        memoryRuns_bytes += size_bytes;
+                    }
+                }
+
+                if (spill) {
+                    run.file = std::tmpfile();
+                    if (run.file == nullptr || (int64_t) std::fwrite(buf.data(), sizeof(TGramCount), n, run.file) != n) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        failed = true;
+                        break;
+                    }
+                    std::rewind(run.file);
+                } else if (move) {
+                    run.data = std::move(buf);
+                    buf = {};
+                } else {
+                    run.data.assign(buf.begin(), buf.end());
+                }
+            }
+        };
+
+        std::vector<std::thread> workers(nThreads);
+        for (auto & w : workers) w = std::thread(worker);
+        for (auto & w : workers) w.join();
+
+        int nSpilled = 0;
+        for (const auto & run : runs) nSpilled += run.file ? 1 : 0;
+        printf("    Wildcard runs: %d threads, %d in memory (%g MB), %d spilled to disk\n",
+               nThreads, nMasks - nSpilled, (double) memoryRuns_bytes/1024.0/1024.0, nSpilled);
+
+        if (failed) {
+            printf("Error: failed to spill wildcard counts to a temporary file\n");
+            for (auto & run : runs) if (run.file) std::fclose(run.file);
+            return false;
+        }
+
+        // the scratch buffers of the workers are released - what is left of the budget is used for the read buffers
+        memoryUsed_bytes -= nThreads*scratchPerThread_bytes;
+
+        if (nSpilled > 0 && memoryBudget_bytes >= 0) {
+            const int64_t blockSize = (memoryBudget_bytes - memoryUsed_bytes)/((int64_t) nSpilled*sizeof(TGramCount));
+            for (auto & run : runs) {
+                if (run.file) {
+                    run.data.reserve(std::max<int64_t>(1024, std::min<int64_t>(1 << 16, blockSize)));
+                }
+            }
+        }
+    }
+
+    // k-way merge - spilled runs are read back in blocks of the capacity reserved above
+    {
+        static const int64_t kBlockSize = 1 << 16;
+
+        struct TCursor {
+            const TGramCount * cur = nullptr;
+            const TGramCount * end = nullptr;
+            int64_t nLeft = 0;
+        };
+
+        std::vector<TCursor> cursors(nMasks);
+
+        auto refill = [&](int ir) {
+            auto & c = cursors[ir];
+            auto & run = runs[ir];
+            if (run.file == nullptr || c.nLeft == 0) {
+                return false;
+            }
+            const int64_t n = std::min<int64_t>(run.data.capacity() > 0 ? run.data.capacity() : kBlockSize, c.nLeft);
+            run.data.resize(n);
+            if ((int64_t) std::fread(run.data.data(), sizeof(TGramCount), n, run.file) != n) {
+                return false;
+            }
+            c.nLeft -= n;
+            c.cur = run.data.data();
+            c.end = run.data.data() + n;
+            return true;
+        };
+
+        using THeapItem = std::pair<Cipher::TCode, int>;
+        std::priority_queue<THeapItem, std::vector<THeapItem>, std::greater<THeapItem>> heap;
+
+        for (int ir = 0; ir < nMasks; ++ir) {
+            auto & c = cursors[ir];
+            if (runs[ir].file) {
+                c.nLeft = runs[ir].n;
+                refill(ir);
+            } else {
+                c.cur = runs[ir].data.data();
+                c.end = runs[ir].data.data() + runs[ir].n;
+            }
+            if (c.cur != c.end) {
+                heap.push({ c.cur->code, ir });
+            }
+        }
+
+        bool ok = true;
+        TGramCount last = { -1, 0 };
+        while (heap.empty() == false) {
+            const auto [code, ir] = heap.top();
+            heap.pop();
+
+            auto & c = cursors[ir];
+            if (last.code == code) {
+                last.count += c.cur->count;
+            } else {
+                if (last.code != -1 && cbCount(last.code, last.count) == false) {
+                    ok = false;
+                    break;
+                }
+                last = *c.cur;
+            }
+
+            if (++c.cur == c.end) {
+                if (refill(ir) == false) {
+                    continue;
+                }
+            }
+            heap.push({ c.cur->code, ir });
+        }
+
+        if (ok && last.code != -1) {
+            ok = cbCount(last.code, last.count);
+        }
+
+        for (auto & run : runs) if (run.file) std::fclose(run.file);
+
+        if (ok == false) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// "KNG2" - cannot be mistaken for the n-gram length at the start of a v1 file
+// v2 files are still loaded, but the Bloom filter has to be built by each process that loads them
+static constexpr uint32_t kFreqMapV2Magic = 0x32474e4b;
+
+// "KNG3" - v2 followed by the Bloom filter words, so that the filter is mapped together with the table
+static constexpr uint32_t kFreqMapV3Magic = 0x33474e4b;
+
+struct TFreqMapHeaderV2 {
+    uint32_t magic = kFreqMapV2Magic;
+    Cipher::TGramLen len = 0;
+    int64_t nTotal = 0;
+    Cipher::TProb pmin = 0;
+    int32_t nBits = 0;
+};
+
+struct TFreqMapHeaderV3 {
+    uint32_t magic = kFreqMapV3Magic;
+    Cipher::TGramLen len = 0;
+    int64_t nTotal = 0;
+    Cipher::TProb pmin = 0;
+    int32_t nBits = 0;
+    int32_t nFilterBits = 0;
+    int32_t padding = 0;
+};
+
+static_assert(sizeof(TFreqMapHeaderV2) % 8 == 0, "Table entries must stay aligned after the header");
+static_assert(sizeof(TFreqMapHeaderV3) % 8 == 0, "Table entries must stay aligned after the header");
+
+// about 16 bits per stored n-gram - a false positive rate of roughly 1%
+int32_t calcFreqTableFilterBits(int64_t nEntries) {
+    int32_t res = 0;
+    while ((4ll << res) < nEntries) ++res;
+
+    return res;
+}
+
+void buildFreqTableFilter(Cipher::TFreqTable & table, int64_t nEntries) {
+    const int32_t nFilterBits = calcFreqTableFilterBits(nEntries);
+
+    auto filter = std::make_shared<std::vector<uint64_t>>(1ull << nFilterBits, 0);
+    for (int64_t h = 0; h < (1ll << table.nBits); ++h) {
+        const auto code = table.entries[h].code;
+        if (code == -1) continue;
+
+        const uint64_t hf = Cipher::TFreqTable::hashFilter(code);
+        (*filter)[(hf >> 32) & ((1ull << nFilterBits) - 1)] |= Cipher::TFreqTable::filterMask(hf);
+    }
+
+    table.nFilterBits = nFilterBits;
+    table.filter = filter->data();
+    table.filterStorage = std::move(filter);
+}
+
+TFreqMapHeaderV3 getFreqMapHeaderV3(const Cipher::TFreqMap & freqMap) {
+    TFreqMapHeaderV3 header;
+    header.len         = freqMap.len;
+    header.nTotal      = freqMap.nTotal;
+    header.pmin        = freqMap.pmin;
+    header.nBits       = freqMap.table.nBits;
+    header.nFilterBits = freqMap.table.nFilterBits;
+
+    return header;
+}
+
+int64_t getFreqMapImageSizeV3(const TFreqMapHeaderV3 & header) {
+    return sizeof(header) + (1ll << header.nBits)*sizeof(Cipher::TFreqTable::TEntry) + (8ll << header.nFilterBits);
+}
+
+// points freqMap.table into a v2 or v3 model image - either a mapped file or a shared memory segment
+bool initFreqMapImage(const char * fname, const char * data, int64_t size, std::shared_ptr<const void> storage, Cipher::TFreqMap & freqMap) {
+    uint32_t magic = 0;
+    if (size >= (int64_t) sizeof(magic)) {
+        std::memcpy(&magic, data, sizeof(magic));
+    }
+
+    TFreqMapHeaderV3 header;
+    int64_t sizeExpected = -1;
+    if (magic == kFreqMapV3Magic && size >= (int64_t) sizeof(header)) {
+        std::memcpy(&header, data, sizeof(header));
+        if (header.nBits >= 1 && header.nBits <= 31 && header.nFilterBits >= 0 && header.nFilterBits <= 40) {
+            sizeExpected = getFreqMapImageSizeV3(header);
+        }
+    } else if (magic == kFreqMapV2Magic && size >= (int64_t) sizeof(TFreqMapHeaderV2)) {
+        TFreqMapHeaderV2 headerV2;
+        std::memcpy(&headerV2, data, sizeof(headerV2));
+        header.len    = headerV2.len;
+        header.nTotal = headerV2.nTotal;
+        header.pmin   = headerV2.pmin;
+        header.nBits  = headerV2.nBits;
+        if (header.nBits >= 1 && header.nBits <= 31) {
+            sizeExpected = sizeof(headerV2) + (1ll << header.nBits)*sizeof(Cipher::TFreqTable::TEntry);
+        }
+    }
+
+    if (sizeExpected != size) {
+        printf("    Invalid v2/v3 n-gram file '%s'\n", fname);
+        return false;
+    }
+
+    freqMap.len = header.len;
+    freqMap.nTotal = header.nTotal;
+    freqMap.pmin = header.pmin;
+    freqMap.prob.clear();
+
+    auto & table = freqMap.table;
+    table = {};
+    table.nBits = header.nBits;
+    table.pmin = header.pmin;
+
+    if (magic == kFreqMapV3Magic) {
+        table.entries = (const Cipher::TFreqTable::TEntry *) (data + sizeof(header));
+        table.nFilterBits = header.nFilterBits;
+        table.filter = (const uint64_t *) (data + sizeof(header) + (1ll << header.nBits)*sizeof(Cipher::TFreqTable::TEntry));
+        table.filterStorage = storage;
+        table.storage = std::move(storage);
+    } else {
+        table.entries = (const Cipher::TFreqTable::TEntry *) (data + sizeof(TFreqMapHeaderV2));
+        table.storage = std::move(storage);
+
+        int64_t nEntries = 0;
+        for (int64_t h = 0; h < (1ll << table.nBits); ++h) {
+            if (table.entries[h].code != -1) ++nEntries;
+        }
+        buildFreqTableFilter(table, nEntries);
+    }
+
+    return true;
+}
+
+bool loadFreqMapImage(const char * fname, Cipher::TFreqMap & freqMap) {
+    std::shared_ptr<const void> storage;
+    const char * data = nullptr;
+    int64_t size = 0;
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+    {
+        std::ifstream fin(fname, std::ios::binary | std::ios::ate);
+        if (fin.good() == false) {
+            printf("    Failed to open file '%s'\n", fname);
+            return false;
+        }
+
+        size = fin.tellg();
+        fin.seekg(0, std::ios::beg);
+
+        auto buf = std::make_shared<std::vector<char>>(size);
+        fin.read(buf->data(), size);
+
+        data = buf->data();
+        storage = std::move(buf);
+    }
+#else
+    {
+        const int fd = open(fname, O_RDONLY);
+        if (fd == -1) {
+            printf("    Failed to open file '%s'\n", fname);
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            printf("    Failed to stat file '%s'\n", fname);
+            return false;
+        }
+        size = st.st_size;
+
+        void * addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (addr == MAP_FAILED) {
+            printf("    Failed to mmap file '%s'\n", fname);
+            return false;
+        }
+
+        data = (const char *) addr;
+        storage = std::shared_ptr<const void>(addr, [size](const void * p) { munmap((void *) p, size); });
+    }
+#endif
+
+    return initFreqMapImage(fname, data, size, std::move(storage), freqMap);
+}
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+
+// shared memory segment layout: TFreqMapSharedHeader followed by a v3 model image
+// the creator sets 'ready' last, after the rest of the segment has been written
+static constexpr uint32_t kFreqMapSharedReady = 0x59444552;
+
+struct TFreqMapSharedHeader {
+    uint32_t ready = 0;
+    int32_t pid = 0;
+    int64_t imageSize = 0;
+};
+
+static_assert(sizeof(TFreqMapSharedHeader) % 8 == 0, "The v3 image must stay aligned after the header");
+
+// all segments of a model file start with a prefix derived from its path, so that the ones left behind by earlier
+// versions of the file can be found and removed
+std::string getFreqMapSharedPrefix(const char * fname) {
+    std::string path = fname;
+    if (char * rp = realpath(fname, nullptr)) {
+        path = rp;
+        free(rp);
+    }
+
+    char res[64];
+    snprintf(res, sizeof(res), "/kbd-audio-%016llx-", (unsigned long long) calcHash(path.data(), path.size()));
+
+    return res;
+}
+
+std::string getFreqMapSharedName(const char * fname, const struct stat & st) {
+    uint64_t h = calcHash(&st.st_size, sizeof(st.st_size));
+    h = calcHash(&st.st_mtime, sizeof(st.st_mtime), h);
+
+    char res[32];
+    snprintf(res, sizeof(res), "%016llx", (unsigned long long) h);
+
+    return getFreqMapSharedPrefix(fname) + res;
+}
+
+// unlinks the segments whose names start with prefix, except keep. returns the number of removed segments
+// the processes that have one of them attached are not affected - only the name is removed
+// the segments can be listed only on Linux - elsewhere, nothing is removed
+int unlinkFreqMapSharedByPrefix(const std::string & prefix, const std::string & keep) {
+    int res = 0;
+
+#if defined(__linux__)
+    DIR * dir = opendir("/dev/shm");
+    if (dir == nullptr) {
+        return 0;
+    }
+
+    while (const struct dirent * entry = readdir(dir)) {
+        const std::string name = std::string("/") + entry->d_name;
+        if (name.compare(0, prefix.size(), prefix) != 0 || name == keep) continue;
+
+        if (shm_unlink(name.c_str()) == 0) {
+            printf("    Removed shared n-gram model '%s'\n", name.c_str());
+            ++res;
+        }
+    }
+
+    closedir(dir);
+#else
+    (void) prefix;
+    (void) keep;
+#endif
+
+    return res;
+}
+
+enum class EAttachResult {
+    Attached,
+    NotReady,
+    Stale,
+    Missing,
+};
+
+EAttachResult attachFreqMapShared(const std::string & name, Cipher::TFreqMap & freqMap) {
+    const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd == -1) {
+        return EAttachResult::Missing;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (int64_t) sizeof(TFreqMapSharedHeader)) {
+        close(fd);
+        return EAttachResult::NotReady;
+    }
+
+    const int64_t size = st.st_size;
+    void * addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        return EAttachResult::Missing;
+    }
+
+    std::shared_ptr<const void> storage(addr, [size](const void * p) { munmap((void *) p, size); });
+
+    TFreqMapSharedHeader header;
+    std::memcpy(&header, addr, sizeof(header));
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (header.ready != kFreqMapSharedReady) {
+        // the creator died before finishing
+        if (header.pid > 0 && kill(header.pid, 0) != 0 && errno == ESRCH) {
+            return EAttachResult::Stale;
+        }
+        return EAttachResult::NotReady;
+    }
+
+    const char * data = (const char *) addr + sizeof(header);
+    if (size != (int64_t) (sizeof(header) + header.imageSize)) {
+        printf("    Invalid shared n-gram model '%s'\n", name.c_str());
+        return EAttachResult::Stale;
+    }
+
+    if (initFreqMapImage(name.c_str(), data, header.imageSize, std::move(storage), freqMap) == false) {
+        return EAttachResult::Stale;
+    }
+
+    freqMap.table.isShared = true;
+
+    return EAttachResult::Attached;
+}
+
+// copies an already loaded model to a new segment. returns false if the segment exists or cannot be created
+bool createFreqMapShared(const std::string & name, const Cipher::TFreqMap & freqMap) {
+    const auto & table = freqMap.table;
+    if (table.entries == nullptr || table.filter == nullptr) {
+        return false;
+    }
+
+    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1) {
+        return false;
+    }
+
+    const auto headerV3 = getFreqMapHeaderV3(freqMap);
+
+    TFreqMapSharedHeader header;
+    header.pid = getpid();
+    header.imageSize = getFreqMapImageSizeV3(headerV3);
+
+    const int64_t size = sizeof(header) + header.imageSize;
+
+    void * addr = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        printf("    Failed to create shared n-gram model '%s'\n", name.c_str());
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    char * data = (char *) addr;
+
+    // the pid allows waiting processes to detect if we die before the segment is ready
+    std::memcpy(data, &header, sizeof(header));
+
+    {
+        char * dst = data + sizeof(header);
+        const int64_t nEntryBytes = (1ll << table.nBits)*sizeof(Cipher::TFreqTable::TEntry);
+
+        std::memcpy(dst, &headerV3, sizeof(headerV3));
+        std::memcpy(dst + sizeof(headerV3), table.entries, nEntryBytes);
+        std::memcpy(dst + sizeof(headerV3) + nEntryBytes, table.filter, 8ll << table.nFilterBits);
+    }
+
+    std::atomic_thread_fence(std::memory_order_release);
+    header.ready = kFreqMapSharedReady;
+    std::memcpy(data, &header, sizeof(header));
+
+    munmap(addr, size);
+
+    return true;
+}
+
+#endif
+
 }
 
 namespace Cipher {
@@ -329,7 +990,11 @@ namespace Cipher {
         return res;
     }
 
-    bool loadFreqMap(const char * fname, TFreqMap & res, double pmin) {
+    bool loadFreqMap(const char * fname, TFreqMap & res, double pmin, int nThreads, int64_t memoryBudget_MB) {
+        if (nThreads <= 0) {
+            nThreads = std::max(1, (int) std::thread::hardware_concurrency());
+        }
+
         auto & len = res.len;
         auto & prob = res.prob;
 
@@ -348,7 +1013,7 @@ namespace Cipher {
         int64_t nfreq = 0;
         res.nTotal = 0;
 
-        std::unordered_map<TCode, int64_t> pi64;
+        std::vector<TGramCount> grams;
 
         while (true) {
             fin >> gram >> nfreq;
@@ -361,17 +1026,36 @@ namespace Cipher {
                 return false;
             }
 
-            TCode idx = calcCode(gram.data(), len);
-            if (pi64[idx] > 0) {
-                printf("Error: duplicate n-gram '%s'\n", gram.c_str());
+            if (nfreq <= 0) {
+                printf("Error: invalid count %ld of n-gram '%s'\n", (long) nfreq, gram.c_str());
                 return false;
             }
-            pi64[idx] = nfreq;
+
+            grams.push_back({ calcCode(gram.data(), len), nfreq });
             res.nTotal += nfreq;
         }
         printf("    Total n-grams loaded = %g\n", (double) res.nTotal);
 
-        // compute wildcard frequencies
+        std::sort(grams.begin(), grams.end(), [](const TGramCount & a, const TGramCount & b) { return a.code < b.code; });
+        for (int64_t i = 1; i < (int64_t) grams.size(); ++i) {
+            if (grams[i - 1].code == grams[i].code) {
+                for (int j = 0; j < len; ++j) gram[j] = 'a' + ((grams[i].code >> 5*(len - j - 1)) & 31) - 1;
+                printf("Error: duplicate n-gram '%s'\n", gram.c_str());
+                return false;
+            }
+        }
+
+        res.pmin = std::log10(pmin);
+        printf("    P-min = %g\n", res.pmin);
+
+        prob.reserve(2*grams.size());
+
+        auto setProb = [&](TCode code, int64_t count) {
+            const double pp = double(count)/res.nTotal;
+            prob[code] = pp < pmin ? res.pmin : std::log10(pp);
+        };
+
+        // compute wildcard frequencies - the merged counts are converted to probabilities as they are produced
         {
             const auto tStart = std::chrono::steady_clock::now();
 
@@ -398,33 +1082,25 @@ namespace Cipher {
                 printf("\n");
             }
 
-            {
-                std::unordered_map<TCode, int64_t> pwild;
-                for (const auto & [i, p] : pi64) {
-                    if (p == 0) {
-                        printf("i = %d, p == 0 - should not happen\n", i);
-                        return false;
-                    }
-
-                    for (const auto & mask : masks) {
-                        pwild[i & mask] += p;
-                    }
+            int64_t nWild = 0;
+            const auto cbCount = [&](TCode code, int64_t count) {
+                if (code == 0 && count != res.nTotal) {
+                    printf("Error: wildcard probability mismatch - p[0] = %ld, expected %ld\n", (long) count, (long) res.nTotal);
+                    return false;
                 }
 
-                printf("Size of pwild = %d\n", (int) pwild.size());
+                setProb(code, count);
+                ++nWild;
 
-                for (auto & [i, p] : pwild) {
-                    pi64[i] = p;
-                }
-
-                printf("Size of pi64 = %d\n", (int) pi64.size());
-            }
+                return true;
+            };
 
-            if (pi64[0] != res.nTotal) {
-                printf("Error: wildcard probability mismatch - p[0] = %ld, expected %ld\n", (long) pi64[0], (long) res.nTotal);
+            if (calcWildcardCounts(masks, grams, nThreads, memoryBudget_MB < 0 ? -1 : memoryBudget_MB*1024*1024, cbCount) == false) {
                 return false;
             }
 
+            printf("    Wildcard n-grams = %ld\n", (long) nWild);
+
             const auto tEnd = std::chrono::steady_clock::now();
             const auto tDiff = std::chrono::duration_cast<std::chrono::milliseconds>(tEnd - tStart).count();
             printf("    Wildcard probabilities computed in %g ms\n", (double) tDiff);
@@ -434,21 +1110,8 @@ namespace Cipher {
         {
             const auto tStart = std::chrono::steady_clock::now();
 
-            res.pmin = std::log10(pmin);
-            printf("    P-min = %g\n", res.pmin);
-
-            for (auto & [i, p] : pi64) {
-                if (p == 0) {
-                    printf("i = %d, p == 0 - should not happen\n", i);
-                    return false;
-                } else {
-                    double pp = double(p)/res.nTotal;
-                    if (pp < pmin) {
-                        prob[i] = res.pmin;
-                    } else {
-                        prob[i] = std::log10(pp);
-                    }
-                }
+            for (const auto & g : grams) {
+                setProb(g.code, g.count);
             }
 
             const auto tEnd = std::chrono::steady_clock::now();
@@ -456,10 +1119,15 @@ namespace Cipher {
             printf("    Probability computation time = %g ms\n", (double) tDiff);
         }
 
-        return true;
+        return buildFreqTable(res);
     }
 
     bool saveFreqMapBinary(const char * fname, const TFreqMap & freqMap) {
+        if (freqMap.table.entries == nullptr) {
+            printf("    Full-precision lookup table is not available\n");
+            return false;
+        }
+
         std::ofstream fout(fname, std::ios::binary);
         if (fout.good() == false) {
             printf("    Failed to open file '%s'\n", fname);
@@ -470,30 +1138,29 @@ namespace Cipher {
         fout.write((const char *) &freqMap.nTotal, sizeof(freqMap.nTotal));
         fout.write((const char *) &freqMap.pmin,   sizeof(freqMap.pmin));
 
-        { int32_t n = freqMap.prob.size(); fout.write((const char *) &n, sizeof(n)); }
-
-        {
-            std::map<TCode, TProb> sorted(freqMap.prob.begin(), freqMap.prob.end());
-
-            std::vector<TCode> keys;
-            for (const auto & [i, p] : sorted) {
-                if (p == freqMap.pmin) {
-                    continue;
-                }
-                keys.push_back(i);
+        // the table contains all n-grams with p != pmin
+        std::vector<TFreqTable::TEntry> sorted;
+        for (uint32_t h = 0; h < (1u << freqMap.table.nBits); ++h) {
+            if (freqMap.table.entries[h].code != -1) {
+                sorted.push_back(freqMap.table.entries[h]);
             }
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const auto & a, const auto & b) { return a.code < b.code; });
 
+        { int32_t n = sorted.size(); fout.write((const char *) &n, sizeof(n)); }
+
+        {
             int32_t is = 0;
-            while (is < (int) keys.size()) {
-                fout.write((const char *) &keys[is],         sizeof(keys[is]));
-                fout.write((const char *) &sorted[keys[is]], sizeof(sorted[keys[is]]));
+            while (is < (int) sorted.size()) {
+                fout.write((const char *) &sorted[is].code, sizeof(sorted[is].code));
+                fout.write((const char *) &sorted[is].prob, sizeof(sorted[is].prob));
 
-                if (is == (int) keys.size() - 1) break;
+                if (is == (int) sorted.size() - 1) break;
 
                 int32_t ie = is + 1;
-                while (keys[ie] - keys[ie - 1] < 256) {
+                while (sorted[ie].code - sorted[ie - 1].code < 256) {
                     ++ie;
-                    if (ie == (int) keys.size()) break;
+                    if (ie == (int) sorted.size()) break;
                     if (ie == is + 255) break;
                 }
 
@@ -501,9 +1168,9 @@ namespace Cipher {
                 fout.write((const char *) &n, sizeof(n));
                 if (n > 0) {
                     for (int i = is + 1; i < ie; ++i) {
-                        uint8_t d = (uint8_t) (keys[i] - keys[i - 1]);
-                        fout.write((const char *) &d,               sizeof(d));
-                        fout.write((const char *) &sorted[keys[i]], sizeof(sorted[keys[i]]));
+                        uint8_t d = (uint8_t) (sorted[i].code - sorted[i - 1].code);
+                        fout.write((const char *) &d,              sizeof(d));
+                        fout.write((const char *) &sorted[i].prob, sizeof(sorted[i].prob));
                     }
                 }
 
@@ -514,6 +1181,28 @@ namespace Cipher {
         return true;
     }
 
+    bool saveFreqMapBinaryV3(const char * fname, const TFreqMap & freqMap) {
+        const auto & table = freqMap.table;
+        if (table.entries == nullptr || table.filter == nullptr) {
+            printf("    Full-precision lookup table is not available\n");
+            return false;
+        }
+
+        std::ofstream fout(fname, std::ios::binary);
+        if (fout.good() == false) {
+            printf("    Failed to open file '%s'\n", fname);
+            return false;
+        }
+
+        const auto header = getFreqMapHeaderV3(freqMap);
+
+        fout.write((const char *) &header, sizeof(header));
+        fout.write((const char *) table.entries, (1ull << header.nBits)*sizeof(TFreqTable::TEntry));
+        fout.write((const char *) table.filter, 8ull << header.nFilterBits);
+
+        return fout.good();
+    }
+
     bool loadFreqMapBinary(const char * fname, TFreqMap & freqMap) {
         std::ifstream fin(fname, std::ios::binary);
         if (fin.good() == false) {
@@ -521,7 +1210,17 @@ namespace Cipher {
             return false;
         }
 
-        fin.read((char *) &freqMap.len,    sizeof(freqMap.len));
+        {
+            uint32_t magic = 0;
+            fin.read((char *) &magic, sizeof(magic));
+            if (magic == kFreqMapV2Magic || magic == kFreqMapV3Magic) {
+                fin.close();
+                return loadFreqMapImage(fname, freqMap);
+            }
+            fin.seekg(0, std::ios::beg);
+        }
+
+        fin.read((char *) &freqMap.len,    sizeof(freqMap.len));
         fin.read((char *) &freqMap.nTotal, sizeof(freqMap.nTotal));
         fin.read((char *) &freqMap.pmin,   sizeof(freqMap.pmin));
 
@@ -532,13 +1231,18 @@ namespace Cipher {
             TCode curi;
             TProb curp;
 
+            // note: files written before v2 was introduced store an n that also counts the omitted
+            // pmin entries, so stop at the end of the file instead of reading past it
             while (n > 0) {
                 fin.read((char *) &curi, sizeof(curi));
                 fin.read((char *) &curp, sizeof(curp));
+                if (fin.eof()) break;
+
                 freqMap.prob[curi] = curp;
 
-                uint8_t n8;
+                uint8_t n8 = 0;
                 fin.read((char *) &n8, sizeof(n8));
+                if (fin.eof()) break;
 
                 if (n8 > 0) {
                     for (int i = 0; i < n8; ++i) {
@@ -556,10 +1260,235 @@ namespace Cipher {
             }
         }
 
+        return buildFreqTable(freqMap);
+    }
+
+    bool loadFreqMapShared(const char * fname, TFreqMap & res) {
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+        return loadFreqMapBinary(fname, res);
+#else
+        struct stat st;
+        if (stat(fname, &st) != 0) {
+            printf("    Failed to open file '%s'\n", fname);
+            return false;
+        }
+
+        const auto name = getFreqMapSharedName(fname, st);
+
+        // wait up to a minute for another process that is currently creating the segment
+        for (int iter = 0; iter < 600; ++iter) {
+            switch (attachFreqMapShared(name, res)) {
+                case EAttachResult::Attached:
+                    {
+                        printf("    Attached to shared n-gram model '%s'\n", name.c_str());
+                        return true;
+                    }
+                case EAttachResult::NotReady:
+                    {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                        continue;
+                    }
+                case EAttachResult::Stale:
+                    {
+                        shm_unlink(name.c_str());
+                    }
+                    [[fallthrough]];
+                case EAttachResult::Missing:
+                    break;
+            }
+
+            if (loadFreqMapBinary(fname, res) == false) {
+                return false;
+            }
+
+            // the segments of the earlier versions of the file would otherwise stay in memory until reboot
+            unlinkFreqMapSharedByPrefix(getFreqMapSharedPrefix(fname), name);
+
+            // if another process got ahead of us, simply keep the private copy
+            if (createFreqMapShared(name, res) && attachFreqMapShared(name, res) == EAttachResult::Attached) {
+                printf("    Created shared n-gram model '%s'\n", name.c_str());
+            }
+
+            return true;
+        }
+
+        printf("    Timeout while waiting for shared n-gram model '%s' - loading a private copy\n", name.c_str());
+
+        return loadFreqMapBinary(fname, res);
+#endif
+    }
+
+    bool unlinkFreqMapShared(const char * fname) {
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+        (void) fname;
+        return true;
+#else
+        int n = unlinkFreqMapSharedByPrefix(getFreqMapSharedPrefix(fname), "");
+
+        // the current segment can be removed even where the segments cannot be listed
+        struct stat st;
+        if (stat(fname, &st) == 0) {
+            const auto name = getFreqMapSharedName(fname, st);
+            if (shm_unlink(name.c_str()) == 0) {
+                printf("    Removed shared n-gram model '%s'\n", name.c_str());
+                ++n;
+            }
+        }
+
+        printf("    Removed %d shared n-gram model segment(s) for '%s'\n", n, fname);
+
         return true;
+#endif
     }
 
-    bool encryptExact(const TParameters & , const std::string & text, TClusters & clusters) {
+    bool buildFreqTable(TFreqMap & freqMap) {
+        auto & table = freqMap.table;
+
+        // n-grams with p == pmin are not stored since this is what a miss returns anyway
+        int64_t n = 0;
+        for (const auto & [i, p] : freqMap.prob) {
+            if (p != freqMap.pmin) ++n;
+        }
+
+        // keep the load factor at most 0.5 so that the linear probe sequences stay short
+        table.nBits = 1;
+        while ((1ll << table.nBits) < 2*n) ++table.nBits;
+        if (table.nBits > 31) {
+            printf("Error: too many n-grams for the lookup table - %ld\n", (long) n);
+            return false;
+        }
+
+        auto entries = std::make_shared<std::vector<TFreqTable::TEntry>>(1ull << table.nBits);
+
+        const uint32_t mask = (1u << table.nBits) - 1;
+        for (const auto & [i, p] : freqMap.prob) {
+            if (p == freqMap.pmin) continue;
+
+            uint32_t h = TFreqTable::hash(i, table.nBits);
+            while ((*entries)[h].code != -1) {
+                h = (h + 1) & mask;
+            }
+            (*entries)[h] = { i, p };
+        }
+
+        table.pmin = freqMap.pmin;
+        table.entries = entries->data();
+        table.nQuantBits = 0;
+        table.nBucketBits = 0;
+        table.maxQuantError = 0.0;
+        table.bucketOffsets = nullptr;
+        table.remainders = nullptr;
+        table.q8 = nullptr;
+        table.q16 = nullptr;
+        table.codebook = nullptr;
+        table.storage = std::move(entries);
+
+        buildFreqTableFilter(table, n);
+
+        return true;
+    }
+
+    bool quantizeFreqTable(TFreqMap & freqMap, int nQuantBits) {
+        auto & table = freqMap.table;
+
+        if (nQuantBits != 8 && nQuantBits != 16) {
+            printf("Error: unsupported number of quantization bits - %d\n", nQuantBits);
+            return false;
+        }
+
+        if (table.entries == nullptr) {
+            printf("Error: the lookup table is not built or is already quantized\n");
+            return false;
+        }
+
+        if (table.isShared) {
+            printf("Error: the lookup table is in shared memory - quantizing it would make a private copy\n");
+            return false;
+        }
+
+        struct TQuantStorage {
+            std::vector<uint32_t> bucketOffsets;
+            std::vector<uint16_t> remainders;
+            std::vector<uint8_t> q8;
+            std::vector<uint16_t> q16;
+            std::vector<TProb> codebook;
+        };
+
+        const int64_t nSlots = 1ll << table.nBits;
+
+        auto qs = std::make_shared<TQuantStorage>();
+
+        std::vector<std::pair<uint32_t, TProb>> sorted;
+        for (int64_t h = 0; h < nSlots; ++h) {
+            const auto & e = table.entries[h];
+            if (e.code == -1) continue;
+
+            sorted.push_back({ ((uint32_t) e.code)*2654435769u, e.prob });
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        {
+            std::vector<TProb> values(sorted.size());
+            for (int64_t i = 0; i < (int64_t) sorted.size(); ++i) {
+                values[i] = sorted[i].second;
+            }
+
+            qs->codebook = calcQuantizationCodebook(std::move(values), 1 << nQuantBits, table.maxQuantError);
+        }
+
+        // 2-4 entries per bucket, but at least 16 bucket bits so that the remainders fit in 16 bits
+        int32_t nBucketBits = 16;
+        while (nBucketBits < 32 && (4ll << nBucketBits) < (int64_t) sorted.size()) ++nBucketBits;
+
+        const int64_t nBuckets = 1ll << nBucketBits;
+        const uint32_t maskRemainder = (1u << (32 - nBucketBits)) - 1;
+
+        qs->bucketOffsets.resize(nBuckets + 1);
+        qs->remainders.resize(sorted.size());
+        if (nQuantBits == 8) {
+            qs->q8.resize(sorted.size());
+        } else {
+            qs->q16.resize(sorted.size());
+        }
+
+        int64_t b = 0;
+        for (int64_t i = 0; i < (int64_t) sorted.size(); ++i) {
+            const auto x = sorted[i].first;
+            while (b <= (x >> (32 - nBucketBits))) qs->bucketOffsets[b++] = i;
+
+            qs->remainders[i] = x & maskRemainder;
+
+            const auto q = quantize(sorted[i].second, qs->codebook);
+            if (nQuantBits == 8) {
+                qs->q8[i] = q;
+            } else {
+                qs->q16[i] = q;
+            }
+        }
+        while (b <= nBuckets) qs->bucketOffsets[b++] = sorted.size();
+
+        const int64_t nBytes = (nBuckets + 1)*sizeof(uint32_t) + sorted.size()*(sizeof(uint16_t) + nQuantBits/8);
+
+        printf("    Quantized %d-gram table to %d bits: codebook size = %d, max error = %g, %.1f bytes per n-gram (was %.1f)\n",
+               freqMap.len, nQuantBits, (int) qs->codebook.size(), table.maxQuantError,
+               (double) nBytes/std::max<int64_t>(1, sorted.size()), (double) nSlots*sizeof(TFreqTable::TEntry)/std::max<int64_t>(1, sorted.size()));
+
+        table.nQuantBits = nQuantBits;
+        table.nBucketBits = nBucketBits;
+        table.entries = nullptr;
+        table.bucketOffsets = qs->bucketOffsets.data();
+        table.remainders = qs->remainders.data();
+        table.q8 = nQuantBits == 8 ? qs->q8.data() : nullptr;
+        table.q16 = nQuantBits == 16 ? qs->q16.data() : nullptr;
+        table.codebook = qs->codebook.data();
+        table.storage = std::move(qs);
+
+        freqMap.prob = {};
+
+        return true;
+    }
+
+    bool encryptExact(TParameters & params, const std::string & text, TClusters & clusters) {
         auto myCharToLetter = kCharToLetter;
 
 		int k = 27;
@@ -577,7 +1506,7 @@ namespace Cipher {
 			alphabetTransformation[i] = i;
 		}
 
-		shuffle(alphabetTransformation);
+		shuffle(params.rng, alphabetTransformation);
 
 		clusters.resize(text.size());
 
@@ -590,19 +1519,39 @@ namespace Cipher {
         return true;
     }
 
+    using TLetterCounts = std::array<int, 28>;
+
+    float calcLetFreqCost(const TLetterCounts & letCount, int nlet) {
+        float letFreqCost = 0.0;
+        {
+            auto & freq = kEnglishLetterWithSpacesFreq;
+            for (int i = 0; i <= 27; ++i) {
+                float curf = 0.01*freq[i] - ((float)(letCount[i]))/((float)(nlet));
+                letFreqCost += curf*curf;
+            }
+        }
+
+        letFreqCost /= 28.0;
+        letFreqCost = sqrt(letFreqCost);
+
+        return letFreqCost;
+    }
+
+    // the n-gram sum is accumulated in double precision, so that the incremental
+    // updates in beamSearch produce the same result
     TProb calcScore(
             const TParameters & params,
             const TFreqMap & freqMap,
-            const std::vector<TLetter> & plain,
-                  std::vector<TProb> & memo) {
-        TProb res = 0.0;
+            const TLetter * plain,
+            int n,
+                  TProb * memo) {
+        double res = 0.0;
 
-        const int n = plain.size();
-        const auto & len  = freqMap.len;
-        const auto & prob = freqMap.prob;
+        const auto & len   = freqMap.len;
+        const auto & table = freqMap.table;
 
         int nlet = 0;
-        std::array<int, 28> letCount;
+        TLetterCounts letCount;
         letCount.fill(0);
         for (int i = 0; i < n; ++i) {
             if (plain[i] >= 0 && plain[i] <= 27) {
@@ -611,17 +1560,7 @@ namespace Cipher {
             }
         }
 
-        float letFreqCost = 0.0;
-        {
-            auto & freq = kEnglishLetterWithSpacesFreq;
-            for (int i = 0; i <= 27; ++i) {
-                float curf = 0.01*freq[i] - ((float)(letCount[i]))/((float)(nlet));
-                letFreqCost += curf*curf;
-            }
-        }
-
-        letFreqCost /= 28.0;
-        letFreqCost = sqrt(letFreqCost);
+        const float letFreqCost = calcLetFreqCost(letCount, nlet);
 
         int i1 = 0;
         int k = len;
@@ -637,11 +1576,13 @@ namespace Cipher {
         }
 
         if (memo[i1 - 1] > 0.5) {
-            memo[i1 - 1] = prob.find(curc) == prob.end() ? freqMap.pmin : prob.at(curc);
+            memo[i1 - 1] = table.get(curc);
         }
         res += memo[i1 - 1];
 
         while (true) {
+            if (i1 >= n) break;
+
             curc &= mask;
 
             auto c = plain[i1++];
@@ -649,24 +1590,20 @@ namespace Cipher {
             curc += c;
 
             if (memo[i1 - 1] > 0.5) {
-                memo[i1 - 1] = prob.find(curc) == prob.end() ? freqMap.pmin : prob.at(curc);
+                memo[i1 - 1] = table.get(curc);
             }
             res += memo[i1 - 1];
-
-            if (i1 >= n) break;
         }
 
         return res/n - params.wEnglishFreq*letFreqCost;
     }
 
-    TClusterToLetterMap getNullCLMap(const TClusters & clusters) {
-        TClusterToLetterMap result;
-
-        for (int i = 0; i < (int) clusters.size(); ++i) {
-            result[clusters[i]] = 0;
-        }
-
-        return result;
+    TProb calcScore(
+            const TParameters & params,
+            const TFreqMap & freqMap,
+            const std::vector<TLetter> & plain,
+                  std::vector<TProb> & memo) {
+        return calcScore(params, freqMap, plain.data(), plain.size(), memo.data());
     }
 
     void translate(
@@ -685,37 +1622,82 @@ namespace Cipher {
         TResult & result) {
         const auto & clusters = result.clusters;
 
-        struct THypothesis {
+        // the hypotheses of a layer are stored as rows in flat arrays that are reused across layers
+        // an expansion is described only by its parent and the new letter - it is scored in-place in the
+        // parent's row and only the expansions that make it to the next layer are materialized
+        // the score of an expansion is obtained incrementally from the parent's n-gram sum and letter counts,
+        // by re-scoring only the n-grams that contain a position of the current cluster
+        // expansions with the same text are scored and kept only once. they are detected with a Zobrist hash
+        // of the assignment, ignoring the clusters whose positions are all hinted since their letter is not used
+        struct TLayer {
+            std::vector<TProb>   p;
+            std::vector<double>  sum;      // sum of the n-gram log-probabilities
+            std::vector<TLetterCounts> letCount;
+            std::vector<TLetter> clMap;    // cluster -> letter, nClusterIds per hypothesis
+            std::vector<TLetter> plain;    // N per hypothesis
+            std::vector<TProb>   memo;     // N per hypothesis
+            std::vector<int>     nused;    // nSymbols + 1 per hypothesis
+            std::vector<uint64_t> hash;
+        };
+
+        struct TExpansion {
             TProb p;
-            TClusterToLetterMap clMap;
-            std::vector<TLetter> plain;
-            std::vector<int> nused;
-            std::vector<TProb> memo;
+            double sum;
+            uint64_t hash;
+            int parent;
+            TLetter letter;
         };
 
         const int N = clusters.size();
         const int nSymbols = 27;
         const int nHypothesesToKeep = params.nHypothesesToKeep;
+        const int nClusterIds = N == 0 ? 1 : *std::max_element(clusters.begin(), clusters.end()) + 1;
+        const int len = freqMap.len;
 
         int nCur = 0;
-        std::vector<THypothesis> hypothesesCur;
-        std::vector<THypothesis> hypothesesNew;
-        hypothesesCur.resize(nHypothesesToKeep);
-        hypothesesNew.resize(nHypothesesToKeep*nSymbols);
+        TLayer layerCur;
+        TLayer layerNew;
+        for (auto layer : { &layerCur, &layerNew }) {
+            layer->p.resize(nHypothesesToKeep);
+            layer->sum.resize(nHypothesesToKeep);
+            layer->letCount.resize(nHypothesesToKeep);
+            layer->hash.resize(nHypothesesToKeep);
+            layer->clMap.resize(nHypothesesToKeep*nClusterIds);
+            layer->plain.resize(nHypothesesToKeep*N);
+            layer->memo.resize(nHypothesesToKeep*N);
+            layer->nused.resize(nHypothesesToKeep*(nSymbols + 1));
+        }
 
         int nHints = 0;
+        int nlet = 0;
         {
-            auto & hcur = hypothesesCur[0];
-            hcur = { 0.0, getNullCLMap(clusters), {}, std::vector<int>(nSymbols + 1, 0), {}};
-            translate(hcur.clMap, clusters, hcur.plain);
-            for (int i = 0; i < (int) params.hint.size(); ++i) {
+            std::fill(layerCur.clMap.begin(), layerCur.clMap.begin() + nClusterIds, 0);
+            std::fill(layerCur.plain.begin(), layerCur.plain.begin() + N, 0);
+            std::fill(layerCur.memo.begin(), layerCur.memo.begin() + N, 1.0);
+            std::fill(layerCur.nused.begin(), layerCur.nused.begin() + nSymbols + 1, 0);
+            for (int i = 0; i < (int) params.hint.size() && i < N; ++i) {
                 if (params.hint[i] != -1) {
-                    hcur.plain[i] = params.hint[i];
+                    layerCur.plain[i] = params.hint[i];
                     ++nHints;
                 }
             }
-            hcur.memo.resize(N, 1.0);
-            hcur.p = calcScore(params, freqMap, hcur.plain, hcur.memo);
+            layerCur.p[0] = calcScore(params, freqMap, layerCur.plain.data(), N, layerCur.memo.data());
+
+            layerCur.sum[0] = 0.0;
+            for (int k = len - 1; k < N; ++k) {
+                layerCur.sum[0] += layerCur.memo[k];
+            }
+
+            layerCur.hash[0] = 0;
+
+            layerCur.letCount[0].fill(0);
+            for (int k = 0; k < N; ++k) {
+                if (layerCur.plain[k] >= 0 && layerCur.plain[k] <= 27) {
+                    ++layerCur.letCount[0][layerCur.plain[k]];
+                    ++nlet;
+                }
+            }
+
             ++nCur;
         }
 
@@ -736,63 +1718,228 @@ namespace Cipher {
             });
         }
 
+        std::vector<int> idxs;
+        std::vector<std::pair<int, int>> runs;
+
+        // the parents are split in contiguous chunks between the threads and each thread selects
+        // its own top nHypothesesToKeep expansions in a bounded heap, which are then merged. ties are
+        // resolved by the order of the expansions, so the result does not depend on the number of threads
+        // an expansion is scored only if an optimistic bound of its score can make it to the heap:
+        // the wildcard n-gram counts are sums over the matching n-grams, so assigning a letter to a cluster
+        // can only decrease the log-probabilities of the affected n-grams and the n-gram sum of the parent
+        // is an upper bound for the sum of the expansion. models without wildcard n-grams are not pruned
+        const int nThreads = std::max(1, params.nThreads);
+        const bool canPrune = N >= len && freqMap.table.get(0) > freqMap.table.pmin;
+
+        std::vector<std::vector<TExpansion>> expansions(nThreads);
+        std::vector<THashSet64> seen(nThreads);
+        std::vector<TExpansion> selected;
+        std::vector<int> heads(nThreads);
+        THashSet64 seenSelected;
+
+        const auto isBetter = [](const TExpansion & a, const TExpansion & b) {
+            if (a.p != b.p) return a.p > b.p;
+            if (a.parent != b.parent) return a.parent < b.parent;
+            return a.letter < b.letter;
+        };
+
+        // calls f(i0, i1, iThread) for each chunk of [0, n)
+        const auto parallelFor = [&](int n, const auto & f) {
+            std::vector<std::thread> workers;
+            for (int t = 1; t < nThreads; ++t) {
+                workers.emplace_back([&f, n, t, nThreads]() { f((t*n)/nThreads, ((t + 1)*n)/nThreads, t); });
+            }
+            f(0, n/nThreads, 0);
+            for (auto & worker : workers) {
+                worker.join();
+            }
+        };
+
+        // sum of the log-probabilities of the n-grams ending in the runs. optionally stores them in the memo
+        const TCode mask = (1 << 5*(len - 1)) - 1;
+        const auto & table = freqMap.table;
+        const auto calcRuns = [&](const TLetter * plain, TProb * memo) {
+            double res = 0.0;
+            for (const auto & [k0, k1] : runs) {
+                TCode curc = 0;
+                for (int k = k0 - len + 1; k < k0; ++k) {
+                    curc <<= 5;
+                    curc += plain[k];
+                }
+                for (int k = k0; k <= k1; ++k) {
+                    curc &= mask;
+                    curc <<= 5;
+                    curc += plain[k];
+
+                    const auto p = table.get(curc);
+                    if (memo) memo[k] = p;
+                    res += p;
+                }
+            }
+            return res;
+        };
+
         for (int i = 0; i < (int) sorted.size(); ++i) {
             auto & kvSorted = sorted[i];
             if (kvSorted.second.empty()) break;
 
             //printf("Processing cluster %2d ('%c') - count = %d\n", kvSorted.first, getEncodedChar(kvSorted.first), (int) kvSorted.second.size());
 
-            int nNew = 0;
-            for (int j = 0; j < nCur; ++j) {
-                const auto & hcur = hypothesesCur[j];
+            const auto cid = kvSorted.first;
 
-                for (int a = 1; a <= nSymbols; ++a) {
-                    // TODO: maybe become parameter
-                    // how many clusters can map to the same symbol
-                    if (hcur.nused[a] > 20) continue;
+            idxs.clear();
+            for (const auto idx : kvSorted.second) {
+                if ((int) params.hint.size() > idx && params.hint[idx] != -1) {
+                    continue;
+                }
+                idxs.push_back(idx);
+            }
 
-                    auto & hnew = hypothesesNew[nNew++];
+            // the n-grams affected by the current cluster, merged into runs of consecutive end positions
+            runs.clear();
+            if (N >= len) {
+                for (const auto idx : idxs) {
+                    const int k0 = std::max(len - 1, idx);
+                    const int k1 = std::min(N - 1, idx + len - 1);
+                    if (runs.empty() == false && runs.back().second >= k0 - 1) {
+                        runs.back().second = std::max(runs.back().second, k1);
+                    } else {
+                        runs.push_back({ k0, k1 });
+                    }
+                }
+            }
 
-                    hnew = hcur;
-                    hnew.nused[a]++;
-                    for (int k = 0; k < (int) kvSorted.second.size(); ++k) {
-                        const auto idx = kvSorted.second[k];
-                        if ((int) params.hint.size() > idx && params.hint[idx] != -1) {
-                            continue;
+            const int nChanged = idxs.size();
+
+
+            parallelFor(nCur, [&](int j0, int j1, int iThread) {
+                // the worst kept expansion is at the front
+                auto & res = expansions[iThread];
+                res.clear();
+
+                seen[iThread].reset((j1 - j0)*nSymbols);
+
+                for (int j = j0; j < j1; ++j) {
+                    TLetter * plain = layerCur.plain.data() + j*N;
+                    const TProb * memo = layerCur.memo.data() + j*N;
+                    const int * nused = layerCur.nused.data() + j*(nSymbols + 1);
+                    const TLetter aOld = layerCur.clMap[j*nClusterIds + cid];
+
+                    double sumOld = 0.0;
+                    for (const auto & [k0, k1] : runs) {
+                        for (int k = k0; k <= k1; ++k) {
+                            sumOld += memo[k];
                         }
-                        hnew.plain[idx] = a;
+                    }
 
-                        const auto idx0 = std::max(0, idx - freqMap.len + 1);
-                        const auto idx1 = std::min(N - 1, idx + freqMap.len - 1);
-                        std::fill(hnew.memo.begin() + idx0, hnew.memo.begin() + idx1 + 1, 1.0);
+                    auto letCount = layerCur.letCount[j];
+                    letCount[aOld] -= nChanged;
+
+                    for (int a = 1; a <= nSymbols; ++a) {
+                        // TODO: maybe become parameter
+                        // how many clusters can map to the same symbol
+                        if (nused[a] > 20) continue;
+
+                        const uint64_t hash = idxs.empty() ? layerCur.hash[j] : layerCur.hash[j] ^ getZobristKey(cid, a);
+                        if (seen[iThread].insert(hash) == false) continue;
+
+                        letCount[a] += nChanged;
+                        const float letFreqCost = calcLetFreqCost(letCount, nlet);
+                        letCount[a] -= nChanged;
+
+                        if (canPrune && (int) res.size() == nHypothesesToKeep) {
+                            const double sumMax = layerCur.sum[j] + 1e-6;
+                            if ((TProb) (sumMax/N - params.wEnglishFreq*letFreqCost) <= res.front().p) {
+                                continue;
+                            }
+                        }
+
+                        for (const auto idx : idxs) {
+                            plain[idx] = a;
+                        }
+
+                        const double sum = layerCur.sum[j] - sumOld + calcRuns(plain, nullptr);
+                        const TExpansion e = { N < len ? (TProb) -1e100 : (TProb) (sum/N - params.wEnglishFreq*letFreqCost), sum, hash, j, a };
+
+                        if ((int) res.size() < nHypothesesToKeep) {
+                            res.push_back(e);
+                            std::push_heap(res.begin(), res.end(), isBetter);
+                        } else if (isBetter(e, res.front())) {
+                            std::pop_heap(res.begin(), res.end(), isBetter);
+                            res.back() = e;
+                            std::push_heap(res.begin(), res.end(), isBetter);
+                        }
+                    }
+
+                    for (const auto idx : idxs) {
+                        plain[idx] = aOld;
                     }
-                    hnew.clMap[kvSorted.first] = a;
-                    hnew.p = calcScore(params, freqMap, hnew.plain, hnew.memo);
                 }
-            }
 
-            // sort hypothesesNew by p
+                std::sort_heap(res.begin(), res.end(), isBetter);
+            });
+
+            // merge the selections of the threads
             {
-                std::vector<std::pair<int, TProb>> sortedNew;
-                for (int j = 0; j < nNew; ++j) {
-                    sortedNew.push_back(std::make_pair(j, hypothesesNew[j].p));
+                selected.clear();
+                seenSelected.reset(nHypothesesToKeep);
+                std::fill(heads.begin(), heads.end(), 0);
+                while ((int) selected.size() < nHypothesesToKeep) {
+                    int best = -1;
+                    for (int t = 0; t < nThreads; ++t) {
+                        if (heads[t] == (int) expansions[t].size()) continue;
+                        if (best == -1 || isBetter(expansions[t][heads[t]], expansions[best][heads[best]])) {
+                            best = t;
+                        }
+                    }
+                    if (best == -1) break;
+
+                    const auto & e = expansions[best][heads[best]++];
+                    if (seenSelected.insert(e.hash)) {
+                        selected.push_back(e);
+                    }
                 }
-                std::sort(sortedNew.begin(), sortedNew.end(), [](const auto & a, const auto & b) {
-                    return a.second > b.second;
-                });
+            }
+
+            nCur = selected.size();
+
+            parallelFor(nCur, [&](int j0, int j1, int ) {
+                for (int j = j0; j < j1; ++j) {
+                    const auto & e = selected[j];
+                    const int k = e.parent;
 
-                //printf("Top p = %g\n", (double) hypothesesNew[sortedNew[0].first].p);
-                //printDecoded(clusters, hypothesesNew[sortedNew[0].first].clMap);
+                    std::copy(layerCur.clMap.begin() + k*nClusterIds, layerCur.clMap.begin() + (k + 1)*nClusterIds, layerNew.clMap.begin() + j*nClusterIds);
+                    std::copy(layerCur.plain.begin() + k*N, layerCur.plain.begin() + (k + 1)*N, layerNew.plain.begin() + j*N);
+                    std::copy(layerCur.memo.begin() + k*N, layerCur.memo.begin() + (k + 1)*N, layerNew.memo.begin() + j*N);
+                    std::copy(layerCur.nused.begin() + k*(nSymbols + 1), layerCur.nused.begin() + (k + 1)*(nSymbols + 1), layerNew.nused.begin() + j*(nSymbols + 1));
 
-                nCur = std::min(nHypothesesToKeep, nNew);
-                for (int j = 0; j < nCur; ++j) {
-                    hypothesesCur[j] = std::move(hypothesesNew[sortedNew[j].first]);
+                    auto & letCount = layerNew.letCount[j];
+                    letCount = layerCur.letCount[k];
+                    letCount[layerNew.clMap[j*nClusterIds + cid]] -= nChanged;
+                    letCount[e.letter] += nChanged;
+
+                    layerNew.p[j] = e.p;
+                    layerNew.sum[j] = e.sum;
+                    layerNew.hash[j] = e.hash;
+                    layerNew.clMap[j*nClusterIds + cid] = e.letter;
+                    layerNew.nused[j*(nSymbols + 1) + e.letter]++;
+
+                    TLetter * plain = layerNew.plain.data() + j*N;
+                    for (const auto idx : idxs) {
+                        plain[idx] = e.letter;
+                    }
+                    calcRuns(plain, layerNew.memo.data() + j*N);
                 }
-            }
+            });
+
+            std::swap(layerCur, layerNew);
         }
 
-        result.clMap = hypothesesCur[0].clMap;
-        result.p = hypothesesCur[0].p;
+        result.clMap.clear();
+        for (const auto & cid : clusters) {
+            result.clMap[cid] = layerCur.clMap[cid];
+        }
+        result.p = layerCur.p[0];
 
         return true;
     }
@@ -801,6 +1948,24 @@ namespace Cipher {
         const TParameters & params,
         const TFreqMap & freqMap,
         TResult & result) {
+        TPlainText plain;
+        TProb p = 0.0;
+        if (refineNearby(params, freqMap, result, plain, p) == false) {
+            return false;
+        }
+
+        printf("%8.3f %8.3f ", (double) p, (double) result.p);
+        printPlain(plain);
+
+        return true;
+    }
+
+    bool refineNearby(
+        const TParameters & params,
+        const TFreqMap & freqMap,
+        const TResult & result,
+        TPlainText & plain,
+        TProb & p) {
 
         const int N = result.clusters.size();
 
@@ -847,8 +2012,8 @@ namespace Cipher {
                 if (converged) break;
             }
 
-            printf("%8.3f %8.3f ", (double) hbest.p, (double) result.p);
-            printPlain(hbest.plain);
+            plain = std::move(hbest.plain);
+            p = hbest.p;
         }
 
         return true;
@@ -856,255 +2021,733 @@ namespace Cipher {
 
     bool generateClustersInitialGuess(
             const TParameters & params,
-            const TSimilarityMap & ccMap,
+            const TTriangularMap & ccMap,
             TClusters & clusters) {
-        int n = ccMap.size();
+        int n = ccMap.n;
 
         int nClusters = n;
         clusters.resize(n);
-        for (int i = 0; i < n; ++i) {
-            clusters[i] = i;
-        }
 
         struct Pair {
             int i;
             int j;
-            double cc;
+            float cc;
 
-            bool operator < (const Pair & a) const { return cc > a.cc; }
+            // strict order - ties are broken by the indices, so the result does not depend on the selection algorithm
+            bool operator < (const Pair & a) const {
+                if (cc != a.cc) return cc > a.cc;
+                if (i != a.i) return i < a.i;
+                return j < a.j;
+            }
         };
 
         std::vector<Pair> ccPairs;
+        ccPairs.reserve(ccMap.data.size());
         for (int i = 0; i < n - 1; ++i) {
+            const auto k0 = ccMap.rowOffset(i);
             for (int j = i + 1; j < n; ++j) {
-                ccPairs.emplace_back(Pair{i, j, ccMap[i][j].cc});
+                ccPairs.emplace_back(Pair{i, j, ccMap.data[k0 + j]});
             }
         }
 
-        std::sort(ccPairs.begin(), ccPairs.end());
+        // union-find - the root of each set is its smallest element
+        std::vector<int> parent(n);
+        for (int i = 0; i < n; ++i) {
+            parent[i] = i;
+        }
 
+        const auto find = [&](int i) {
+            int r = i;
+            while (parent[r] != r) r = parent[r];
+            while (parent[i] != r) {
+                const int next = parent[i];
+                parent[i] = r;
+                i = next;
+            }
+            return r;
+        };
+
+        // merge the most similar pairs first. usually only a small fraction of the pairs is needed,
+        // so instead of sorting all of them, the next best batch is selected when the sorted ones run out
         {
-            std::vector<bool> used(n);
+            const int nPairs = ccPairs.size();
+
+            int nSorted = 0;
+            for (int k = 0; k < nPairs; ++k) {
+                if (k == nSorted) {
+                    const int nNext = std::min(nPairs, std::max(2*nSorted, 4*n));
+                    if (nNext < nPairs) {
+                        std::nth_element(ccPairs.begin() + nSorted, ccPairs.begin() + nNext, ccPairs.end());
+                    }
+                    std::sort(ccPairs.begin() + nSorted, ccPairs.begin() + nNext);
+                    nSorted = nNext;
+                }
+
+                int ri = find(ccPairs[k].i);
+                int rj = find(ccPairs[k].j);
+
+                if (ri == rj) continue;
+
+                if (ri > rj) {
+                    std::swap(ri, rj);
+                }
+
+                parent[rj] = ri;
+                --nClusters;
+
+                if (nClusters <= params.maxClusters) break;
+            }
+        }
+
+        // number the clusters in the order of their first element
+        {
+            int cnt = 0;
+            std::vector<int> id(n, -1);
+            for (int i = 0; i < n; ++i) {
+                const int r = find(i);
+                if (id[r] == -1) {
+                    id[r] = cnt++;
+                }
+                clusters[i] = id[r];
+            }
+        }
+
+        //printf("nClusters = %d\n", nClusters);
+        for (auto & cid : clusters) {
+            assert(cid >= 0 && cid < params.maxClusters);
+        }
+
+        return true;
+    }
+
+    bool mutateClusters(TParameters & params, TClusters & clusters) {
+        int idx = 0;
+        TClusterId cid = 0;
+        if (mutateClusters(params, clusters, idx, cid) == false) {
+            return false;
+        }
+
+        clusters[idx] = cid;
+
+        return true;
+    }
+
+    bool mutateClusters(TParameters & params, const TClusters & clusters, int & idx, TClusterId & cid) {
+        int n = clusters.size();
+
+        idx = params.rng.uniform(n);
+        cid = 1 + params.rng.uniform(params.maxClusters - 1);
+
+        return true;
+    }
+
+    double calcPClustersDelta(
+            const TTriangularMap & logMap,
+            const TTriangularMap & logMapInv,
+            const TClusters & clusters,
+            int idx,
+            TClusterId cid) {
+        const int n = clusters.size();
+        const auto cidOld = clusters[idx];
+        if (cid == cidOld) {
+            return 0.0;
+        }
+
+        // only the pairs (idx, j) with j in the old or in the new cluster change their term
+        double res = 0.0;
+
+        // j < idx - column idx of the triangle
+        for (int j = 0; j < idx; ++j) {
+            const auto c = clusters[j];
+            if (c != cidOld && c != cid) continue;
+
+            const auto k = logMap.rowOffset(j) + idx;
+            const double d = logMap.data[k] - logMapInv.data[k];
+            res += c == cid ? d : -d;
+        }
+
+        // j > idx - row idx of the triangle
+        const auto k0 = logMap.rowOffset(idx);
+        for (int j = idx + 1; j < n; ++j) {
+            const auto c = clusters[j];
+            if (c != cidOld && c != cid) continue;
+
+            const double d = logMap.data[k0 + j] - logMapInv.data[k0 + j];
+            res += c == cid ? d : -d;
+        }
+
+        return res/((n*(n-1))/2.0);
+    }
+
+    double calcPClusters(
+            const TParameters & ,
+            const TTriangularMap & ,
+            const TTriangularMap & logMap,
+            const TTriangularMap & logMapInv,
+            const TClusters & clusters,
+            const TClusterToLetterMap & ) {
 
-            for (int k = 0; k < (int) ccPairs.size(); ++k) {
-                int i = ccPairs[k].i;
-                int j = ccPairs[k].j;
+        double res = 0.0;
+        int n = clusters.size();
 
-                if (clusters[i] == clusters[j]) continue;
+        for (int j = 0; j < n - 1; ++j) {
+            const auto cj = clusters[j];
+            const auto k0 = logMap.rowOffset(j);
+            for (int i = j + 1; i < n; ++i) {
+                if (clusters[i] == cj) {
+                    res += logMap.data[k0 + i];
+                } else {
+                    res += logMapInv.data[k0 + i];
+                }
+            }
+        }
 
-                int cidi = clusters[i];
-                int cidj = clusters[j];
+        return res/((n*(n-1))/2.0);
+    }
 
-                if (used[cidi] || used[cidj]) continue;
+    bool normalizeSimilarityMap(
+            const TParameters & ,
+            const TSimilarityMap & ccMap,
+            TTriangularMap & ccNorm,
+            TTriangularMap & logMap,
+            TTriangularMap & logMapInv) {
+        int n = ccMap.size();
 
-                if (cidi > cidj) {
-                    std::swap(cidi, cidj);
+        double ccMin = std::numeric_limits<double>::max();
+        double ccMax = std::numeric_limits<double>::min();
+
+        for (int j = 0; j < n - 1; ++j) {
+            for (int i = j + 1; i < n; ++i) {
+                ccMin = std::min(ccMin, ccMap[j][i].cc);
+                ccMax = std::max(ccMax, ccMap[j][i].cc);
+            }
+        }
+
+        ccMin -= 1e-6;
+        ccMax += 1e-6;
+
+        //printf("ccMax = %g, ccMin = %g\n", ccMax, ccMin);
+
+        ccNorm.resize(n);
+        logMap.resize(n);
+        logMapInv.resize(n);
+
+        for (int j = 0; j < n - 1; ++j) {
+            const auto k0 = ccNorm.rowOffset(j);
+            for (int i = j + 1; i < n; ++i) {
+                double v = ccMap[j][i].cc;
+                //v = (v - ccMin)/(ccMax - ccMin);
+                if (v < 0.50*(ccMin + ccMax)) {
+                    v = ccMin;
+                } else {
+                    v = (v - ccMin)/(ccMax - ccMin);
                 }
+                //v = 1.0 - std::exp(-1.1f*v);
+
+                ccNorm.data[k0 + i] = v;
+                logMap.data[k0 + i] = std::log(v);
+                logMapInv.data[k0 + i] = std::log(1.0 - v);
+            }
+        }
+
+        return true;
+    }
+
+    char getEncodedChar(TClusterId cid) {
+        if (cid >= 1 && cid <= 26) {
+            return 'a' + cid - 1;
+        } else if (cid == 27) {
+            return '_';
+        }
+
+        return 'A' + cid - 28;
+    }
+
+    TLetter decode(const TClusters & t, int idx, const TClusterToLetterMap & clMap, const THint & hint) {
+        const auto & cid = t[idx];
+        auto let = clMap.at(cid);
+        if ((int) hint.size() > idx && hint[idx] != -1) {
+            let = hint[idx];
+        }
+
+        return let;
+    }
+
+    void printEncoded(const TClusters & t) {
+        for (const auto & cid : t) {
+            printf("%c", getEncodedChar(cid));
+        }
+
+        printf("\n");
+    }
+
+    void printDecoded(const TClusters & t, const TClusterToLetterMap & clMap, const THint & hint) {
+        for (int i = 0; i < (int) t.size(); ++i) {
+            const auto let = decode(t, i, clMap, hint);
+
+            if (let >= 1 && let <= 26) {
+                printf("%c", 'a' + let - 1);
+            } else if (let == 27) {
+                printf("_");
+            } else {
+                printf(".");
+            }
+        }
+
+        printf("\n");
+    }
+
+    void printPlain(const std::vector<TLetter> & t) {
+        for (int i = 0; i < (int) t.size(); ++i) {
+            const auto let = t[i];
+
+            if (let >= 1 && let <= 26) {
+                printf("%c", 'a' + let - 1);
+            } else if (let == 27) {
+                printf("_");
+            } else {
+                printf(".");
+            }
+        }
+
+        printf("\n");
+    }
+
+    //
+    // Simulated annealing
+    //
+
+    // iterations between the temperature updates
+    static constexpr int kItersPerTemp = 1000;
+    static constexpr double kTempMin = 0.000001;
+
+    // single simulated annealing step at temperature T
+    // cur.pClusters is the score of cur.clusters and all contains the improvements found so far
+    static void annealStep(
+            TParameters & params,
+            const TTriangularMap & logMap,
+            const TTriangularMap & logMapInv,
+            double T,
+            TResult & cur,
+            std::vector<TResult> & all,
+            int & nNoImprovement) {
+        int idx = 0;
+        TClusterId cid = 0;
+        Cipher::mutateClusters(params, cur.clusters, idx, cid);
+
+        const auto pCur = cur.pClusters;
+        const auto pNew = pCur + calcPClustersDelta(logMap, logMapInv, cur.clusters, idx, cid);
+
+        // check if we should accept the new value
+        if (pNew >= pCur) {
+            cur.clusters[idx] = cid;
+            cur.pClusters = pNew;
+        } else {
+            // accept with probability
+            const auto pAccept = std::exp((pNew - pCur)/T);
+            if (pAccept > params.rng.frand()) {
+                //printf("    [annealStep] N = %d, T = %8.3f, pNew = %g, pCur = %g, pAccept = %g\n", nNoImprovement, T, pNew, pCur, pAccept);
+                cur.clusters[idx] = cid;
+                cur.pClusters = pNew;
+            }
+        }
+
+        // the tolerance is for the rounding errors of the incremental updates, which would otherwise
+        // register as improvements
+        if (cur.pClusters > all.back().pClusters + 1e-9) {
+            all.push_back(cur);
+            nNoImprovement = 0;
+        } else {
+            nNoImprovement += 1;
+        }
+    }
 
-                for (int p = 0; p < n; ++p) {
-                    if (clusters[p] == cidj) {
-                        clusters[p] = cidi;
+    // picks up to nClusterings diverse clusterings among the last improvements
+    static std::vector<TResult> selectClusterings(const std::vector<TResult> & all, int nClusterings) {
+        const auto pClustersBest = all.back().pClusters;
+
+        std::vector<TResult> result;
+        {
+            result.push_back(all.back());
+
+            for (int i = 1; i < nClusterings; ++i) {
+                int jBest = -1;
+                double pDiffMax = -1.0;
+                for (int j = 5*all.size()/6; j < (int) all.size(); ++j) {
+                    if (all[j].pClusters < 1.1*pClustersBest) {
+                        continue;
+                    }
+                    double pDiffMin = std::numeric_limits<double>::max();
+                    for (int k = 0; k < (int) result.size(); ++k) {
+                        double pDiff = std::fabs(all[j].pClusters - result[k].pClusters);
+                        if (pDiffMin > pDiff) {
+                            pDiffMin = pDiff;
+                        }
+                    }
+                    if (pDiffMax < pDiffMin) {
+                        pDiffMax = pDiffMin;
+                        jBest = j;
                     }
                 }
-                used[cidj] = true;
-                --nClusters;
 
-                if (nClusters <= params.maxClusters) break;
+                if (pDiffMax < 0.005 || jBest == -1) {
+                    break;
+                }
+
+                result.push_back(all[jBest]);
             }
         }
 
+        std::sort(result.begin(), result.end(), [](const TResult & a, const TResult & b) {
+            return a.pClusters > b.pClusters;
+        });
+
+        return result;
+    }
+
+    // anneals a single clustering chain (see getClusteringsMultiChain) and returns its diverse top clusterings
+    static std::vector<TResult> runClusteringChain(
+            const TParameters & params,
+            const TTriangularMap & ccMap,
+            const TTriangularMap & logMap,
+            const TTriangularMap & logMapInv,
+            int maxClusters,
+            int iChain,
+            int nClusterings,
+            int nReplicas) {
+        nReplicas = std::max(1, nReplicas);
+
+        // replica k runs at kTempRatio^k times the temperature of the coldest one
+        const double kTempRatio = 4.0;
+
+        auto paramsChain = params;
+        paramsChain.maxClusters = maxClusters;
+        paramsChain.rng = params.rng.split(iChain);
+
+        struct TReplica {
+            TResult cur;
+            std::vector<TResult> all;
+            int nNoImprovement = 0;
+        };
+
+        std::vector<TReplica> replicas(nReplicas);
         {
-            int cnt = 0;
-            std::map<int, int> used;
-            for (auto & cid : clusters) {
-                if (used[cid] > 0) continue;
-                used[cid] = ++cnt;
+            TResult init;
+            generateClustersInitialGuess(paramsChain, ccMap, init.clusters);
+            init.pClusters = calcPClusters(paramsChain, ccMap, logMap, logMapInv, init.clusters, init.clMap);
+
+            for (auto & replica : replicas) {
+                replica.cur = init;
+                replica.all.push_back(init);
+            }
+        }
+
+        int nTotalIterations = 0;
+        int nExchanges = 0;
+
+        double T = params.temp0;
+        while (true) {
+            double Tk = T;
+            for (auto & replica : replicas) {
+                annealStep(paramsChain, logMap, logMapInv, Tk, replica.cur, replica.all, replica.nNoImprovement);
+                Tk *= kTempRatio;
+            }
+
+            nTotalIterations++;
+            if (nTotalIterations % kItersPerTemp == 0) {
+                for (auto & replica : replicas) {
+                    replica.cur.pClusters = calcPClusters(paramsChain, ccMap, logMap, logMapInv, replica.cur.clusters, replica.cur.clMap);
+                }
+
+                // parallel tempering - try to exchange the states of neighbouring temperatures
+                Tk = T;
+                for (int k = 0; k < nReplicas - 1; ++k) {
+                    auto & a = replicas[k].cur;
+                    auto & b = replicas[k + 1].cur;
+
+                    const double pExchange = std::exp((b.pClusters - a.pClusters)*(1.0/Tk - 1.0/(Tk*kTempRatio)));
+                    if (pExchange > paramsChain.rng.frand()) {
+                        std::swap(a, b);
+                        ++nExchanges;
+                    }
+                    Tk *= kTempRatio;
+                }
+
+                T = T * params.coolingRate;
+                if (T < kTempMin) {
+                    T = kTempMin;
+                }
             }
 
-            for (auto & cid : clusters) {
-                cid = used[cid] - 1;
+            if (replicas[0].nNoImprovement > 1000 && T < 2*kTempMin) {
+                break;
             }
         }
 
-        //printf("nClusters = %d\n", nClusters);
-        for (auto & cid : clusters) {
-            assert(cid >= 0 && cid < params.maxClusters);
-        }
+        printf("    [runClusteringChain] maxClusters = %2d, nTotalIterations = %d, nExchanges = %d, pFinal = %g\n",
+               paramsChain.maxClusters, nTotalIterations, nExchanges, replicas[0].cur.pClusters);
 
-        return true;
+        // the coldest replica holds the best states
+        return selectClusterings(replicas[0].all, nClusterings);
     }
 
-    bool mutateClusters(const TParameters & params, TClusters & clusters) {
-        int n = clusters.size();
+    std::vector<TResult> getClusteringsMultiChain(
+            const TParameters & params,
+            const TSimilarityMap & similarityMap,
+            const std::vector<int> & maxClusters,
+            int nClusterings,
+            int nReplicas) {
+        // the normalized maps do not depend on maxClusters and are shared by all chains
+        TTriangularMap ccMap;
+        TTriangularMap logMap;
+        TTriangularMap logMapInv;
+        normalizeSimilarityMap(params, similarityMap, ccMap, logMap, logMapInv);
+
+        const int nChains = maxClusters.size();
+        const int nThreads = std::max(1, std::min(params.nThreads, nChains));
+
+        std::vector<std::vector<TResult>> results(nChains);
+
+        std::atomic<int> iNext(0);
+        const auto worker = [&]() {
+            while (true) {
+                const int iChain = iNext++;
+                if (iChain >= nChains) break;
 
-        for (int i = 0; i < 1; ++i) {
-            int idx = rand()%n;
+                results[iChain] = runClusteringChain(params, ccMap, logMap, logMapInv, maxClusters[iChain], iChain, nClusterings, nReplicas);
+            }
+        };
 
-            clusters[idx] = 1 + rand()%(params.maxClusters - 1);
+        std::vector<std::thread> workers;
+        for (int i = 1; i < nThreads; ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto & w : workers) {
+            w.join();
         }
 
-        return true;
-    }
-
-    double calcPClusters(
-            const TParameters & ,
-            const TSimilarityMap & ,
-            const TSimilarityMap & logMap,
-            const TSimilarityMap & logMapInv,
-            const TClusters & clusters,
-            const TClusterToLetterMap & ) {
-
-        double res = 0.0;
-        int n = clusters.size();
-
-        for (int j = 0; j < n - 1; ++j) {
-            for (int i = j + 1; i < n; ++i) {
-                if (clusters[i] == clusters[j]) {
-                    res += logMap[j][i].cc;
-                } else {
-                    res += logMapInv[j][i].cc;
-                }
+        std::vector<TResult> res;
+        for (auto & r : results) {
+            for (auto & c : r) {
+                res.push_back(std::move(c));
             }
         }
 
-        return res/((n*(n-1))/2.0);
+        return res;
     }
 
-    bool normalizeSimilarityMap(
-            const TParameters & ,
-            TSimilarityMap & ccMap,
-            TSimilarityMap & logMap,
-            TSimilarityMap & logMapInv) {
-        int n = ccMap.size();
+    bool decodePipelined(
+            const TParameters & params,
+            const TFreqMap & freqMap,
+            const TSimilarityMap & similarityMap,
+            const std::vector<int> & maxClusters,
+            int nClusterings,
+            int nReplicas,
+            int queueSize,
+            const TDecodeCallback & cbDecoded) {
+        TTriangularMap ccMap;
+        TTriangularMap logMap;
+        TTriangularMap logMapInv;
+        normalizeSimilarityMap(params, similarityMap, ccMap, logMap, logMapInv);
+
+        const int nChains = maxClusters.size();
+        const int nThreads = std::max(1, params.nThreads);
+        queueSize = std::max(1, queueSize);
+
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        // max-heap by pClusters, so that the most likely clusterings are decoded first
+        std::vector<TResult> queue;
+        const auto cmp = [](const TResult & a, const TResult & b) { return a.pClusters < b.pClusters; };
+
+        // pClusters of the clusterings that are queued, waiting to be queued or being decoded
+        std::multiset<decltype(TResult::pClusters)> outstanding;
+
+        // decoded, but not yet passed to cbDecoded - max-heap by pClusters
+        struct TDecoded {
+            TResult result;
+            TPlainText refined;
+            TProb pRefined = 0.0;
+
+            bool operator<(const TDecoded & other) const { return result.pClusters < other.result.pClusters; }
+        };
 
-        double ccMin = std::numeric_limits<double>::max();
-        double ccMax = std::numeric_limits<double>::min();
+        std::vector<TDecoded> decoded;
 
-        for (int j = 0; j < n - 1; ++j) {
-            for (int i = j + 1; i < n; ++i) {
-                ccMin = std::min(ccMin, ccMap[j][i].cc);
-                ccMax = std::max(ccMax, ccMap[j][i].cc);
-            }
-        }
+        int iNextChain = 0;
+        int nRunning = 0;
+        int nDecoding = 0;
 
-        ccMin -= 1e-6;
-        ccMax += 1e-6;
+        std::mutex mutexCallback;
 
-        //printf("ccMax = %g, ccMin = %g\n", ccMax, ccMin);
+        // a decoded clustering is passed to cbDecoded once no outstanding clustering has a higher pClusters
+        // popping under mutexCallback keeps the calls in that order across the threads
+        const auto emit = [&]() {
+            std::lock_guard<std::mutex> lockCallback(mutexCallback);
 
-        for (int j = 0; j < n; ++j) {
-            for (int i = 0; i < n; ++i) {
-                if (i == j) {
-                    ccMap[j][i].cc = 1.0;
-                    continue;
-                }
+            std::vector<TDecoded> ready;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                while (decoded.empty() == false) {
+                    if (outstanding.empty() == false && decoded.front().result.pClusters < *outstanding.rbegin()) break;
 
-                auto & v = ccMap[j][i].cc;
-                //v = (v - ccMin)/(ccMax - ccMin);
-                if (v < 0.50*(ccMin + ccMax)) {
-                    v = ccMin;
-                } else {
-                    v = (v - ccMin)/(ccMax - ccMin);
+                    std::pop_heap(decoded.begin(), decoded.end());
+                    ready.push_back(std::move(decoded.back()));
+                    decoded.pop_back();
                 }
-                //v = 1.0 - std::exp(-1.1f*v);
             }
-        }
 
-        logMap = ccMap;
+            for (const auto & d : ready) {
+                cbDecoded(d.result, d.refined, d.pRefined);
+            }
+        };
 
-        for (int j = 0; j < n; ++j) {
-            for (int i = 0; i < n; ++i) {
-                if (i == j) {
-                    logMap[j][i].cc = 0.0;
-                    continue;
+        // each worker decodes the queued clusterings and, if there are none, runs the next clustering chain
+        const auto worker = [&]() {
+            // the parallelism is across the clusterings, so each beam search runs on a single thread
+            auto paramsWorker = params;
+            paramsWorker.nThreads = 1;
+
+            // called with nDecoding already incremented for this clustering
+            const auto decode = [&](TResult clustering) {
+                TDecoded d;
+                beamSearch(paramsWorker, freqMap, clustering);
+                refineNearby(paramsWorker, freqMap, clustering, d.refined, d.pRefined);
+                d.result = std::move(clustering);
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    outstanding.erase(outstanding.find(d.result.pClusters));
+                    decoded.push_back(std::move(d));
+                    std::push_heap(decoded.begin(), decoded.end());
+                    --nDecoding;
                 }
+                cv.notify_all();
 
-                auto & v = logMap[j][i].cc;
-                v = std::log(v);
-            }
-        }
+                emit();
+            };
 
-        logMapInv = ccMap;
+            while (true) {
+                TResult clustering;
+                int iChain = -1;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&]() { return queue.empty() == false || iNextChain < nChains || nRunning == 0; });
+
+                    if (queue.empty() == false) {
+                        std::pop_heap(queue.begin(), queue.end(), cmp);
+                        clustering = std::move(queue.back());
+                        queue.pop_back();
+                        ++nDecoding;
+                    } else if (iNextChain < nChains) {
+                        iChain = iNextChain++;
+                        ++nRunning;
+                    } else {
+                        break;
+                    }
+                }
 
-        for (int j = 0; j < n; ++j) {
-            for (int i = 0; i < n; ++i) {
-                if (i == j) {
-                    logMap[j][i].cc = -1e6;
+                if (iChain == -1) {
+                    cv.notify_all();
+                    decode(std::move(clustering));
                     continue;
                 }
 
-                auto & v = logMapInv[j][i].cc;
-                v = std::log(1.0 - v);
-            }
-        }
-
-        return true;
-    }
-
-    char getEncodedChar(TClusterId cid) {
-        if (cid >= 1 && cid <= 26) {
-            return 'a' + cid - 1;
-        } else if (cid == 27) {
-            return '_';
-        }
+                auto clusterings = runClusteringChain(params, ccMap, logMap, logMapInv, maxClusters[iChain], iChain, nClusterings, nReplicas);
 
-        return 'A' + cid - 28;
-    }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    for (const auto & c : clusterings) {
+                        outstanding.insert(c.pClusters);
+                    }
+                }
 
-    TLetter decode(const TClusters & t, int idx, const TClusterToLetterMap & clMap, const THint & hint) {
-        const auto & cid = t[idx];
-        auto let = clMap.at(cid);
-        if ((int) hint.size() > idx && hint[idx] != -1) {
-            let = hint[idx];
-        }
+                // wait for room in the queue while the other threads are decoding
+                // if none is, this thread decodes the most likely clustering itself, so the queue never grows beyond queueSize
+                for (auto & c : clusterings) {
+                    TResult best;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [&]() { return (int) queue.size() < queueSize || nDecoding == 0; });
+
+                        queue.push_back(std::move(c));
+                        std::push_heap(queue.begin(), queue.end(), cmp);
+                        if ((int) queue.size() <= queueSize) {
+                            continue;
+                        }
 
-        return let;
-    }
+                        std::pop_heap(queue.begin(), queue.end(), cmp);
+                        best = std::move(queue.back());
+                        queue.pop_back();
+                        ++nDecoding;
+                    }
+                    cv.notify_all();
 
-    void printEncoded(const TClusters & t) {
-        for (const auto & cid : t) {
-            printf("%c", getEncodedChar(cid));
-        }
+                    decode(std::move(best));
+                }
 
-        printf("\n");
-    }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    --nRunning;
+                }
+                cv.notify_all();
+            }
 
-    void printDecoded(const TClusters & t, const TClusterToLetterMap & clMap, const THint & hint) {
-        for (int i = 0; i < (int) t.size(); ++i) {
-            const auto let = decode(t, i, clMap, hint);
+            cv.notify_all();
+        };
 
-            if (let >= 1 && let <= 26) {
-                printf("%c", 'a' + let - 1);
-            } else if (let == 27) {
-                printf("_");
-            } else {
-                printf(".");
-            }
+        std::vector<std::thread> workers;
+        for (int i = 1; i < nThreads; ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto & w : workers) {
+            w.join();
         }
 
-        printf("\n");
+        emit();
+
+        return true;
     }
 
-    void printPlain(const std::vector<TLetter> & t) {
-        for (int i = 0; i < (int) t.size(); ++i) {
-            const auto let = t[i];
+    TDecodeCallback getPrintDecodedCallback(const THint & hint, std::vector<TResult> & decoded) {
+        TProb pBest = -1e9;
 
-            if (let >= 1 && let <= 26) {
-                printf("%c", 'a' + let - 1);
-            } else if (let == 27) {
-                printf("_");
-            } else {
-                printf(".");
+        return [&hint, &decoded, pBest](const TResult & result, const TPlainText & refined, TProb pRefined) mutable {
+            printf("%8.3f %8.3f ", result.p, result.pClusters);
+            printDecoded(result.clusters, result.clMap, hint);
+            printf("%8.3f %8.3f ", pRefined, result.p);
+            printPlain(refined);
+
+            if (pRefined > pBest) {
+                pBest = pRefined;
+                printf("[+] Best so far: %8.3f ", pRefined);
+                printPlain(refined);
             }
-        }
 
-        printf("\n");
+            decoded.push_back(result);
+        };
     }
 
     //
     // Processor
     //
 
+    namespace {
+        // the model is identified by its n-gram length, total count and pmin - hashing all probabilities on each init
+        // would be too slow for the large models
+        uint64_t calcFingerprint(const TFreqMap & freqMap, const TSimilarityMap & similarityMap) {
+            uint64_t h = calcHash(similarityMap);
+            h = calcHash(&freqMap.len, sizeof(freqMap.len), h);
+            h = calcHash(&freqMap.nTotal, sizeof(freqMap.nTotal), h);
+            h = calcHash(&freqMap.pmin, sizeof(freqMap.pmin), h);
+
+            return h;
+        }
+    }
+
     Processor::Processor() {
     }
 
@@ -1114,10 +2757,10 @@ namespace Cipher {
             const TSimilarityMap & similarityMap) {
         m_params = params;
         m_freqMap = &freqMap;
-        m_similarityMap = similarityMap;
         m_curResult = {};
+        m_fingerprint = calcFingerprint(freqMap, similarityMap);
 
-        normalizeSimilarityMap(m_params, m_similarityMap, m_logMap, m_logMapInv);
+        normalizeSimilarityMap(m_params, similarityMap, m_similarityMap, m_logMap, m_logMapInv);
         generateClustersInitialGuess(m_params, m_similarityMap, m_curResult.clusters);
 
         //Cipher::beamSearch(m_params, *m_freqMap, m_curResult);
@@ -1141,50 +2784,26 @@ namespace Cipher {
 
         int nNoImprovement = 0;
         int nTotalIterations = 0;
-        auto clustersNew = m_curResult.clusters;
 
         std::vector<TResult> all;
         all.push_back(m_curResult);
 
         // simulated annealing
         double T = params.temp0;
-        double TMin = 0.000001;
+        double TMin = kTempMin;
         double alpha = params.coolingRate;
 
         while (true) {
-            clustersNew = m_curResult.clusters;
-            Cipher::mutateClusters(m_params, clustersNew);
-
-            // m_pCur is the old value
-            const auto pNew = calcPClusters(m_params, m_similarityMap, m_logMap, m_logMapInv, clustersNew, m_curResult.clMap);
-
-            // check if we should accept the new value
-            if (pNew >= m_pCur) {
-                m_curResult.clusters = clustersNew;
-                m_curResult.pClusters = pNew;
-                m_pCur = pNew;
-            } else {
-                // accept with probability
-                const auto pAccept = std::exp((pNew - m_pCur)/T);
-                if (pAccept > frand()) {
-                    //printf("    [getClusterings] N = %d, T = %8.3f, pNew = %g, pCur = %g, pAccept = %g\n", nNoImprovement, T, pNew, m_pCur, pAccept);
-                    m_curResult.clusters = clustersNew;
-                    m_curResult.pClusters = pNew;
-                    m_pCur = pNew;
-                }
-            }
-
-            // check if we should stop
-            if (m_pCur > all.back().pClusters) {
-                all.push_back(m_curResult);
-                nNoImprovement = 0;
-            } else {
-                nNoImprovement += 1;
-            }
+            annealStep(m_params, m_logMap, m_logMapInv, T, m_curResult, all, nNoImprovement);
+            m_pCur = m_curResult.pClusters;
 
             // update temperature
             nTotalIterations++;
-            if (nTotalIterations % 1000 == 0) {
+            if (nTotalIterations % kItersPerTemp == 0) {
+                // discard the accumulated rounding errors of the incremental updates
+                m_pCur = calcPClusters(m_params, m_similarityMap, m_logMap, m_logMapInv, m_curResult.clusters, m_curResult.clMap);
+                m_curResult.pClusters = m_pCur;
+
                 T = T * alpha;
                 if (T < TMin) {
                     T = TMin;
@@ -1200,58 +2819,20 @@ namespace Cipher {
         printf("    [getClusterings] nTotalIterations = %d\n", nTotalIterations);
         printf("    [getClusterings] pFinal = %g\n", m_curResult.pClusters);
 
-        const auto pClustersBest = all.back().pClusters;
-
-        std::vector<TResult> result;
-        {
-            result.push_back(all.back());
-
-            for (int i = 1; i < nClusterings; ++i) {
-                int jBest = -1;
-                double pDiffMax = -1.0;
-                for (int j = 5*all.size()/6; j < (int) all.size(); ++j) {
-                    if (all[j].pClusters < 1.1*pClustersBest) {
-                        continue;
-                    }
-                    double pDiffMin = std::numeric_limits<double>::max();
-                    for (int k = 0; k < (int) result.size(); ++k) {
-                        double pDiff = std::fabs(all[j].pClusters - result[k].pClusters);
-                        if (pDiffMin > pDiff) {
-                            pDiffMin = pDiff;
-                        }
-                    }
-                    if (pDiffMax < pDiffMin) {
-                        pDiffMax = pDiffMin;
-                        jBest = j;
-                    }
-                }
-
-                if (pDiffMax < 0.005 || jBest == -1) {
-                    break;
-                }
-
-                result.push_back(all[jBest]);
-            }
-        }
-
-        std::sort(result.begin(), result.end(), [](const TResult & a, const TResult & b) {
-            return a.pClusters > b.pClusters;
-        });
-
-        return result;
+        return selectClusterings(all, nClusterings);
     }
 
     bool Processor::compute() {
-        auto clustersNew = m_curResult.clusters;
+        int idx = 0;
+        TClusterId cid = 0;
 
         for (int iter = 0; iter < m_params.nIters; ++iter) {
-            clustersNew = m_curResult.clusters;
-            Cipher::mutateClusters(m_params, clustersNew);
-            const auto pNew = calcPClusters(m_params, m_similarityMap, m_logMap, m_logMapInv, clustersNew, m_curResult.clMap);
+            Cipher::mutateClusters(m_params, m_curResult.clusters, idx, cid);
+            const auto pNew = m_pCur + calcPClustersDelta(m_logMap, m_logMapInv, m_curResult.clusters, idx, cid);
 
             ++m_nInitialIters;
             if (pNew > m_pCur) {
-                m_curResult.clusters = clustersNew;
+                m_curResult.clusters[idx] = cid;
                 m_pCur = pNew;
                 if (m_pCur > m_pZero) {
                     m_pZero = m_pCur;
@@ -1266,6 +2847,11 @@ namespace Cipher {
             ++m_curResult.id;
         }
 
+        // m_pCur is only advanced by deltas above - re-sync it so that the rounding errors do not accumulate
+        // over the endless compute() loops of the GUIs (and end up in the checkpoints)
+        m_pCur = calcPClusters(m_params, m_similarityMap, m_logMap, m_logMapInv, m_curResult.clusters, m_curResult.clMap);
+        m_curResult.pClusters = m_pCur;
+
         return true;
     }
 
@@ -1273,8 +2859,186 @@ namespace Cipher {
         return m_curResult;
     }
 
-    const TSimilarityMap & Processor::getSimilarityMap() const {
+    const TTriangularMap & Processor::getSimilarityMap() const {
         return m_similarityMap;
     }
 
+    //
+    // Checkpoints
+    //
+
+    static constexpr uint32_t kStateMagic = 0x3350544b; // "KTP3"
+    static constexpr int32_t kStateVersion = 2;
+
+    bool Processor::saveState(std::ostream & out) const {
+        writeValue(out, kStateMagic);
+        writeValue(out, kStateVersion);
+        writeValue(out, m_fingerprint);
+
+        writeValue(out, m_params.minClusters);
+        writeValue(out, m_params.maxClusters);
+        writeValue(out, m_params.nInitialIters);
+        writeValue(out, m_params.nIters);
+        writeValue(out, m_params.temp0);
+        writeValue(out, m_params.coolingRate);
+        writeValue(out, m_params.wEnglishFreq);
+        writeValue(out, m_params.nHypothesesToKeep);
+        writeValue(out, m_params.nThreads);
+        writeVector(out, m_params.hint);
+        writeValue(out, m_params.rng.s);
+
+        writeValue(out, m_nInitialIters);
+        writeValue(out, m_pZero);
+
+        writeValue(out, m_curResult.id);
+        writeValue(out, m_curResult.p);
+        {
+            const int32_t n = m_curResult.clMap.size();
+            writeValue(out, n);
+            for (const auto & kv : m_curResult.clMap) {
+                writeValue(out, kv.first);
+                writeValue(out, kv.second);
+            }
+        }
+        writeVector(out, m_curResult.clusters);
+
+        return out.good();
+    }
+
+    bool Processor::loadState(std::istream & in) {
+        uint32_t magic = 0;
+        int32_t version = 0;
+        if (readValue(in, magic) == false || magic != kStateMagic) {
+            printf("    Invalid processor state\n");
+            return false;
+        }
+        if (readValue(in, version) == false || version != kStateVersion) {
+            printf("    Unsupported processor state version %d\n", version);
+            return false;
+        }
+
+        uint64_t fingerprint = 0;
+        if (readValue(in, fingerprint) == false || fingerprint != m_fingerprint) {
+            printf("    Processor state is for a different model or similarity map\n");
+            return false;
+        }
+
+        const int32_t n = m_similarityMap.n;
+
+        auto params = m_params;
+        int nInitialIters = 0;
+        double pZero = 0.0;
+        TResult result;
+
+        bool ok = true;
+        ok = ok && readValue(in, params.minClusters);
+        ok = ok && readValue(in, params.maxClusters);
+        ok = ok && readValue(in, params.nInitialIters);
+        ok = ok && readValue(in, params.nIters);
+        ok = ok && readValue(in, params.temp0);
+        ok = ok && readValue(in, params.coolingRate);
+        ok = ok && readValue(in, params.wEnglishFreq);
+        ok = ok && readValue(in, params.nHypothesesToKeep);
+        ok = ok && readValue(in, params.nThreads);
+        ok = ok && readVector(in, params.hint, n);
+        ok = ok && readValue(in, params.rng.s);
+
+        ok = ok && readValue(in, nInitialIters);
+        ok = ok && readValue(in, pZero);
+
+        ok = ok && readValue(in, result.id);
+        ok = ok && readValue(in, result.p);
+        {
+            int32_t nMap = 0;
+            ok = ok && readValue(in, nMap) && nMap >= 0 && nMap <= params.maxClusters;
+            for (int i = 0; ok && i < nMap; ++i) {
+                TClusterId cid = 0;
+                TLetter letter = 0;
+                ok = ok && readValue(in, cid) && readValue(in, letter);
+                result.clMap[cid] = letter;
+            }
+        }
+        ok = ok && readVector(in, result.clusters, n);
+
+        if (ok == false) {
+            printf("    Truncated or corrupted processor state\n");
+            return false;
+        }
+
+        if ((int) result.clusters.size() != n) {
+            printf("    Processor state is for %d key presses, but the similarity map has %d\n", (int) result.clusters.size(), n);
+            return false;
+        }
+
+        if (params.minClusters < 1 || params.maxClusters < params.minClusters ||
+            isValidClustering(result.clusters, result.clMap, params.hint, params.maxClusters) == false) {
+            printf("    Processor state has out of range cluster ids or letters\n");
+            return false;
+        }
+
+        m_params = std::move(params);
+        m_nInitialIters = nInitialIters;
+        m_pZero = pZero;
+        m_curResult = std::move(result);
+
+        // the score of the loaded clustering is not trusted from the file
+        m_pCur = calcPClusters(m_params, m_similarityMap, m_logMap, m_logMapInv, m_curResult.clusters, m_curResult.clMap);
+        m_curResult.pClusters = m_pCur;
+
+        return true;
+    }
+
+    bool saveProcessors(const char * fname, const std::map<int, Processor> & processors) {
+        return saveFileAtomic(fname, [&](std::ostream & out) {
+            const int32_t n = processors.size();
+            writeValue(out, n);
+            for (const auto & kv : processors) {
+                const int32_t id = kv.first;
+                writeValue(out, id);
+                if (kv.second.saveState(out) == false) {
+                    return false;
+                }
+            }
+
+            return out.good();
+        });
+    }
+
+    bool loadProcessors(const char * fname, std::map<int, Processor> & processors) {
+        std::ifstream fin(fname, std::ios::binary);
+        if (fin.good() == false) {
+            printf("    Failed to open file '%s'\n", fname);
+            return false;
+        }
+
+        int32_t n = 0;
+        if (readValue(fin, n) == false || n != (int) processors.size()) {
+            printf("    Checkpoint '%s' has %d processors, expected %d\n", fname, n, (int) processors.size());
+            return false;
+        }
+
+        // all or nothing
+        auto res = processors;
+        std::set<int32_t> loaded;
+        for (int i = 0; i < n; ++i) {
+            int32_t id = -1;
+            if (readValue(fin, id) == false || res.count(id) == 0) {
+                printf("    Checkpoint '%s' has unknown processor %d\n", fname, id);
+                return false;
+            }
+            if (loaded.insert(id).second == false) {
+                printf("    Checkpoint '%s' has processor %d more than once\n", fname, id);
+                return false;
+            }
+            if (res[id].loadState(fin) == false) {
+                printf("    Failed to load processor %d from '%s'\n", id, fname);
+                return false;
+            }
+        }
+
+        processors = std::move(res);
+
+        return true;
+    }
+
 }
@@ -9,6 +9,8 @@
 
 #include <map>
 #include <cmath>
+#include <functional>
+#include <memory>
 #include <vector>
 #include <string>
 #include <unordered_map>
@@ -40,8 +42,99 @@ namespace Cipher {
 
         // beam search
         int nHypothesesToKeep = 100;
+        int nThreads = 1;
 
         THint hint = {};
+
+        // used by all stochastic steps - seed with rng.seed(x) for reproducible runs
+        TRandom rng;
+    };
+
+    // immutable open-addressing hash table with the n-gram log-probabilities
+    // built once after the model is loaded and used in the scoring hot loops
+    // n-grams that are not present in the table have probability pmin
+    // the entries are either owned by the table or point into a memory-mapped v2/v3 model file
+    // optionally, the probabilities can be quantized to 8 or 16 bit indices into a codebook (see quantizeFreqTable)
+    struct TFreqTable {
+        struct TEntry {
+            TCode code = -1;
+            TProb prob = 0;
+        };
+
+        // part of the v2/v3 file formats - do not change
+        static inline uint32_t hash(TCode code, int32_t nBits) {
+            return (((uint32_t) code)*2654435769u) >> (32 - nBits);
+        }
+
+        int32_t nBits = 0;
+        TProb pmin = 0;
+        const TEntry * entries = nullptr;
+
+        // quantized form - used when entries == nullptr
+        // the codes are not stored explicitly: x = code*2654435769u is a bijection, so the entries are sorted by x,
+        // grouped in 2^nBucketBits buckets by its top bits and only the low (32 - nBucketBits) <= 16 bits are kept
+        // remainders[i] and q8[i]/q16[i] belong to the same entry, bucket b is [bucketOffsets[b], bucketOffsets[b + 1])
+        int32_t nQuantBits = 0;
+        int32_t nBucketBits = 0;
+        double maxQuantError = 0.0;
+        const uint32_t * bucketOffsets = nullptr;
+        const uint16_t * remainders = nullptr;
+        const uint8_t * q8 = nullptr;
+        const uint16_t * q16 = nullptr;
+        const TProb * codebook = nullptr;
+
+        std::shared_ptr<const void> storage;
+
+        // the entries point into a shared memory segment (see loadFreqMapShared)
+        bool isShared = false;
+
+        // register-blocked Bloom filter with the codes in the table, consulted before probing it
+        // a code sets 4 bits in a single 64-bit word, so a miss is answered with a single load
+        // hashFilter and filterMask are part of the v3 file format - do not change
+        int32_t nFilterBits = 0;
+        const uint64_t * filter = nullptr;
+        std::shared_ptr<const void> filterStorage;
+
+        static inline uint64_t hashFilter(TCode code) {
+            uint64_t x = (uint64_t) (uint32_t) code;
+            x = (x ^ (x >> 30))*0xbf58476d1ce4e5b9ull;
+            x = (x ^ (x >> 27))*0x94d049bb133111ebull;
+            return x ^ (x >> 31);
+        }
+
+        static inline uint64_t filterMask(uint64_t h) {
+            return (1ull << (h & 63)) | (1ull << ((h >> 6) & 63)) | (1ull << ((h >> 12) & 63)) | (1ull << ((h >> 18) & 63));
+        }
+
+        inline bool mayContain(TCode code) const {
+            const uint64_t h = hashFilter(code);
+            const uint64_t m = filterMask(h);
+            return (filter[(h >> 32) & ((1ull << nFilterBits) - 1)] & m) == m;
+        }
+
+        inline TProb get(TCode code) const {
+            if (filter && mayContain(code) == false) return pmin;
+
+            if (entries) {
+                const uint32_t mask = (1u << nBits) - 1;
+                uint32_t h = hash(code, nBits);
+                while (true) {
+                    const auto & e = entries[h];
+                    if (e.code == code) return e.prob;
+                    if (e.code == -1) return pmin;
+                    h = (h + 1) & mask;
+                }
+            }
+
+            const uint32_t x = ((uint32_t) code)*2654435769u;
+            const uint32_t b = x >> (32 - nBucketBits);
+            const uint16_t r = x & ((1u << (32 - nBucketBits)) - 1);
+            for (uint32_t i = bucketOffsets[b]; i < bucketOffsets[b + 1]; ++i) {
+                if (remainders[i] == r) return codebook[q8 ? q8[i] : q16[i]];
+            }
+
+            return pmin;
+        }
     };
 
     struct TFreqMap {
@@ -49,6 +142,7 @@ namespace Cipher {
         int64_t nTotal = 0;
         TProb pmin = 0;
         std::unordered_map<TCode, TProb> prob;
+        TFreqTable table;
     };
 
     struct TResult {
@@ -59,15 +153,68 @@ namespace Cipher {
         TClusters clusters;
     };
 
+    // upper triangle (i < j) of a symmetric n x n matrix, stored contiguously row by row
+    // used for the normalized similarity maps of the clustering, where only the pairs i < j are needed
+    struct TTriangularMap {
+        int32_t n = 0;
+        std::vector<float> data;
+
+        void resize(int32_t n_) {
+            n = n_;
+            data.assign(((int64_t) n*(n - 1))/2, 0.0f);
+        }
+
+        // element (i, j) with i < j is data[rowOffset(i) + j]
+        inline int64_t rowOffset(int32_t i) const {
+            return ((int64_t) i*(2*n - i - 1))/2 - i - 1;
+        }
+
+        inline float get(int32_t i, int32_t j) const {
+            return i < j ? data[rowOffset(i) + j] : data[rowOffset(j) + i];
+        }
+    };
+
     TCode calcCode(const char * data, int n);
 
     // n-grams with lower probability than pmin are assigned cost = log10(pmin)
-    bool loadFreqMap(const char * fname, TFreqMap & res, double pmin = 0.000001);
+    // the wildcard n-gram counts are computed on nThreads threads (<= 0 - all available cores)
+    // intermediate results exceeding memoryBudget_MB are spilled to temporary files (< 0 - no limit)
+    bool loadFreqMap(const char * fname, TFreqMap & res, double pmin = 0.000001, int nThreads = -1, int64_t memoryBudget_MB = -1);
 
     bool saveFreqMapBinary(const char * fname, const TFreqMap & res);
+
+    // v3 format: a header followed by the prebuilt lookup table and its Bloom filter
+    // it is used directly after mmap, so loading is instant and the pages are shared between processes
+    // only res.table is populated - res.prob stays empty
+    bool saveFreqMapBinaryV3(const char * fname, const TFreqMap & res);
+
+    // loads the v1 (delta-compressed) and the v2/v3 (mmap-able) binary formats
+    // v2 is v3 without the filter - it is still loaded, but each process builds a private copy of the filter
     bool loadFreqMapBinary(const char * fname, TFreqMap & res);
 
-    bool encryptExact(const TParameters & params, const std::string & text, TClusters & clusters);
+    // same as loadFreqMapBinary, but the lookup table is placed in a named shared memory segment
+    // the first process that loads the model creates the segment and all later ones attach to it read-only,
+    // so they start without reloading and use almost no extra memory. the segment is keyed by the path, size
+    // and modification time of the model file and persists until reboot (see /dev/shm on Linux) or until it is
+    // removed with unlinkFreqMapShared. creating a segment removes the ones left by earlier versions of the file
+    // falls back to loadFreqMapBinary on platforms without POSIX shared memory
+    // the shared table cannot be quantized - that would need a private copy and defeat the purpose
+    bool loadFreqMapShared(const char * fname, TFreqMap & res);
+
+    // removes the shared memory segments of the model file - the processes that have them attached keep working
+    bool unlinkFreqMapShared(const char * fname);
+
+    // (re)builds freqMap.table from freqMap.prob - called by the load functions
+    bool buildFreqTable(TFreqMap & freqMap);
+
+    // converts the lookup table to nQuantBits (8 or 16) bit codebook indices and releases freqMap.prob
+    // the table shrinks from 16-32 bytes per stored n-gram (8 byte slots at load factor 0.25-0.5)
+    // to about 4-5 (8 bits) or 5-6 (16 bits) bytes: a 16-bit remainder, the index and the bucket offsets
+    // the absolute error of each log10 probability, and hence of the calcScore result, is at most
+    // freqMap.table.maxQuantError. quantized models cannot be saved and tables in shared memory cannot be quantized
+    bool quantizeFreqTable(TFreqMap & freqMap, int nQuantBits);
+
+    bool encryptExact(TParameters & params, const std::string & text, TClusters & clusters);
 
     bool beamSearch(
             const TParameters & params,
@@ -79,26 +226,47 @@ namespace Cipher {
             const TFreqMap & freqMap,
             TResult & result);
 
+    // same as above, but returns the refined text and its score instead of printing them
+    bool refineNearby(
+            const TParameters & params,
+            const TFreqMap & freqMap,
+            const TResult & result,
+            TPlainText & plain,
+            TProb & p);
+
     bool generateClustersInitialGuess(
             const TParameters & params,
-            const TSimilarityMap & ccMap,
+            const TTriangularMap & ccMap,
             TClusters & clusters);
 
-    bool mutateClusters(const TParameters & params, TClusters & clusters);
+    bool mutateClusters(TParameters & params, TClusters & clusters);
+
+    // selects a random single-element mutation without applying it: clusters[idx] = cid
+    bool mutateClusters(TParameters & params, const TClusters & clusters, int & idx, TClusterId & cid);
+
+    // change of calcPClusters when clusters[idx] is changed to cid - O(n) instead of O(n^2)
+    double calcPClustersDelta(
+            const TTriangularMap & logMap,
+            const TTriangularMap & logMapInv,
+            const TClusters & clusters,
+            int idx,
+            TClusterId cid);
 
     double calcPClusters(
             const TParameters & ,
-            const TSimilarityMap & ,
-            const TSimilarityMap & logMap,
-            const TSimilarityMap & logMapInv,
+            const TTriangularMap & ,
+            const TTriangularMap & logMap,
+            const TTriangularMap & logMapInv,
             const TClusters & clusters,
             const TClusterToLetterMap & clMap);
 
+    // ccNorm - the normalized similarity, logMap / logMapInv - log(ccNorm) / log(1 - ccNorm)
     bool normalizeSimilarityMap(
             const TParameters & ,
-            TSimilarityMap & ccMap,
-            TSimilarityMap & logMap,
-            TSimilarityMap & logMapInv);
+            const TSimilarityMap & ccMap,
+            TTriangularMap & ccNorm,
+            TTriangularMap & logMap,
+            TTriangularMap & logMapInv);
 
     char getEncodedChar(TClusterId);
 
@@ -108,6 +276,38 @@ namespace Cipher {
     void printDecoded(const TClusters & t, const TClusterToLetterMap & clMap, const THint & hint);
     void printPlain(const std::vector<TLetter> & t);
 
+    // runs an independent simulated annealing chain for each maxClusters value on params.nThreads threads
+    // with nReplicas > 1, each chain consists of replicas at increasing temperatures which exchange their
+    // states (parallel tempering). returns the diverse top clusterings of each chain, in the order of the chains
+    std::vector<TResult> getClusteringsMultiChain(
+            const TParameters & params,
+            const TSimilarityMap & similarityMap,
+            const std::vector<int> & maxClusters,
+            int nClusterings,
+            int nReplicas = 1);
+
+    // beamSearch result, the refineNearby text and its score
+    using TDecodeCallback = std::function<void(const TResult & result, const TPlainText & refined, TProb pRefined)>;
+
+    // clustering and decoding in a single pipeline on params.nThreads threads
+    // the clusterings of the chains (see getClusteringsMultiChain) are put in a queue of up to queueSize entries and
+    // are decoded with beamSearch + refineNearby while the rest of the chains are still running. a chain that finishes
+    // while the queue is full waits for room, so the most likely clusterings are decoded first
+    // cbDecoded is called from one thread at a time in decreasing pClusters order, as soon as no clustering that is
+    // still queued or being decoded is more likely. a chain that finishes later can still produce a more likely one
+    bool decodePipelined(
+            const TParameters & params,
+            const TFreqMap & freqMap,
+            const TSimilarityMap & similarityMap,
+            const std::vector<int> & maxClusters,
+            int nClusterings,
+            int nReplicas,
+            int queueSize,
+            const TDecodeCallback & cbDecoded);
+
+    // prints each decoded result and the best refined text so far, and appends the results to decoded
+    TDecodeCallback getPrintDecodedCallback(const THint & hint, std::vector<TResult> & decoded);
+
     class Processor {
     public:
         Processor();
@@ -124,19 +324,35 @@ namespace Cipher {
 
         int getIters() const { return m_nInitialIters; }
         const TResult & getResult() const;
-        const TSimilarityMap & getSimilarityMap() const;
+        const TTriangularMap & getSimilarityMap() const;
+
+        // binary snapshot of the search - the parameters (including the RNG state), the current result and the counters
+        // the model and the similarity map are not part of it, only their fingerprint - loading fails unless the Processor
+        // has been init()-ed with the same ones. on failure, the Processor is left unchanged
+        bool saveState(std::ostream & out) const;
+        bool loadState(std::istream & in);
 
     private:
         TParameters m_params;
         const TFreqMap* m_freqMap = nullptr;
-        TSimilarityMap m_similarityMap;
-        TSimilarityMap m_logMap;
-        TSimilarityMap m_logMapInv;
+        TTriangularMap m_similarityMap;
+        TTriangularMap m_logMap;
+        TTriangularMap m_logMapInv;
 
         int m_nInitialIters = 0;
         double m_pCur = 0.0f;
         double m_pZero = 0.0f;
 
         TResult m_curResult;
+
+        // identifies the model and the similarity map the Processor was init()-ed with
+        uint64_t m_fingerprint = 0;
     };
+
+    // checkpoint with the states of all processors, written with saveFileAtomic
+    bool saveProcessors(const char * fname, const std::map<int, Processor> & processors);
+
+    // resumes the processors from a checkpoint - they must be init()-ed with the same ids, model and similarity map
+    // on failure, none of the processors is changed
+    bool loadProcessors(const char * fname, std::map<int, Processor> & processors);
 }
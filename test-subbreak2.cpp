@@ -0,0 +1,55 @@
+#include "subbreak2.h"
+
+#include <cmath>
+
+int main(int argc, char ** argv) {
+    printf("Usage: %s n-gram.txt [n-gram.txt ...]\n", argv[0]);
+    if (argc < 2) {
+        return -1;
+    }
+
+    std::string plain = R"(
+Dave found joy in the daily routine of life. He awoke at the same time, ate the same breakfast and drove the same commute. He worked at a job that never seemed to change and he got home at 6 pm sharp every night. It was who he had been for the last ten years and he had no idea that was all about to change.
+    )";
+
+    // long enough for the single-cluster changes to take the sparse path of the incremental scoring
+    {
+        const auto text = plain;
+        for (int i = 0; i < 7; ++i) {
+            plain += text;
+        }
+    }
+
+    int nFailed = 0;
+
+    // the incremental scoring of the annealing loops must match calcScore0 for every model and letter set
+    for (int iArg = 1; iArg < argc; ++iArg) {
+        Cipher::TFreqMap freqMap;
+        if (Cipher::loadFreqMap(argv[iArg], freqMap) == false) {
+            return -1;
+        }
+
+        for (bool includeSpaces : { false, true }) {
+            Cipher::TParameters params;
+            params.includeSpaces = includeSpaces;
+            params.rng.seed(iArg);
+
+            TClusters clusters;
+            Cipher::encryptExact(params, plain, clusters);
+
+            params.maxClusters = 27;
+            for (auto & c : clusters) {
+                params.maxClusters = std::max(params.maxClusters, c + 1);
+            }
+
+            const double maxDiff = Cipher::checkScoreUpdate(params, freqMap, clusters, 20000);
+
+            // the full and the incremental score sum the same n-grams in a different order
+            const bool ok = maxDiff <= 1e-6;
+            printf("%s: %d-gram score update, includeSpaces = %d - max difference = %g\n", ok ? "OK" : "FAILED", freqMap.len, includeSpaces, maxDiff);
+            nFailed += ok ? 0 : 1;
+        }
+    }
+
+    return nFailed == 0 ? 0 : 1;
+}
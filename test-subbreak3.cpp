@@ -51,5 +51,110 @@ Dave found joy in the daily routine of life. He awoke at the same time, ate the
         printf("Time: %ld ms\n", tDiff.count());
     }
 
-    return 0;
+    // round-trip checks of the model file and the quantized table against the lookups of the loaded model
+    std::vector<Cipher::TCode> codes;
+    {
+        const auto & table = freqMap.table;
+        for (int64_t h = 0; table.entries && h < (1ll << table.nBits); ++h) {
+            if (table.entries[h].code != -1) codes.push_back(table.entries[h].code);
+        }
+
+        TRandom rng(1);
+        for (int i = 0; i < 100000; ++i) {
+            codes.push_back(rng.uniform(1 << (5*freqMap.len)));
+        }
+    }
+
+    int nFailed = 0;
+
+    {
+        const std::string fname = std::string(argv[1]) + ".test.binary";
+
+        Cipher::TFreqMap freqMapV3;
+        if (Cipher::saveFreqMapBinaryV3(fname.c_str(), freqMap) == false ||
+            Cipher::loadFreqMapBinary(fname.c_str(), freqMapV3) == false) {
+            printf("FAILED: v3 save/load\n");
+            ++nFailed;
+        } else {
+            int nMismatch = 0;
+            for (const auto & code : codes) {
+                if (freqMapV3.table.get(code) != freqMap.table.get(code)) ++nMismatch;
+            }
+
+            printf("%s: v3 save/load - %d codes, %d mismatches\n", nMismatch ? "FAILED" : "OK", (int) codes.size(), nMismatch);
+            nFailed += nMismatch ? 1 : 0;
+        }
+
+        std::remove(fname.c_str());
+    }
+
+    for (int nQuantBits : { 8, 16 }) {
+        Cipher::TFreqMap freqMapQ;
+        if (Cipher::loadFreqMapBinary((std::string(argv[1]) + ".binary").c_str(), freqMapQ) == false ||
+            Cipher::quantizeFreqTable(freqMapQ, nQuantBits) == false) {
+            printf("FAILED: quantization to %d bits\n", nQuantBits);
+            ++nFailed;
+            continue;
+        }
+
+        double maxError = 0.0;
+        for (const auto & code : codes) {
+            maxError = std::max(maxError, (double) std::fabs(freqMapQ.table.get(code) - freqMap.table.get(code)));
+        }
+
+        const bool ok = maxError <= freqMapQ.table.maxQuantError;
+        printf("%s: quantization to %d bits - max error = %g, bound = %g\n", ok ? "OK" : "FAILED", nQuantBits, maxError, freqMapQ.table.maxQuantError);
+        nFailed += ok ? 0 : 1;
+    }
+
+    // a processor resumed from a checkpoint must continue exactly like the one that kept running
+    {
+        const int n = result.clusters.size();
+
+        TRandom rng(2);
+        TSimilarityMap similarityMap(n, std::vector<TMatch>(n));
+        for (int i = 0; i < n; ++i) {
+            for (int j = i + 1; j < n; ++j) {
+                const float cc = (result.clusters[i] == result.clusters[j] ? 0.7f : 0.2f) + 0.3f*rng.frand();
+                similarityMap[i][j].cc = cc;
+                similarityMap[j][i].cc = cc;
+            }
+        }
+
+        std::map<int, Cipher::Processor> processors;
+        std::map<int, Cipher::Processor> processorsResumed;
+        for (int k = 0; k < 3; ++k) {
+            Cipher::TParameters paramsProcessor;
+            paramsProcessor.maxClusters = 30 + k;
+            paramsProcessor.rng.seed(100 + k);
+
+            processors[k].init(paramsProcessor, freqMap, similarityMap);
+            processorsResumed[k].init(paramsProcessor, freqMap, similarityMap);
+        }
+
+        const std::string fname = std::string(argv[1]) + ".test.state";
+
+        for (int iter = 0; iter < 5; ++iter) for (auto & [k, processor] : processors) processor.compute();
+        const bool saved = Cipher::saveProcessors(fname.c_str(), processors);
+        for (int iter = 0; iter < 5; ++iter) for (auto & [k, processor] : processors) processor.compute();
+
+        const bool loaded = Cipher::loadProcessors(fname.c_str(), processorsResumed);
+        for (int iter = 0; iter < 5; ++iter) for (auto & [k, processor] : processorsResumed) processor.compute();
+
+        std::remove(fname.c_str());
+
+        bool ok = saved && loaded;
+        for (int k = 0; k < 3 && ok; ++k) {
+            const auto & a = processors[k].getResult();
+            const auto & b = processorsResumed[k].getResult();
+
+            ok = ok && a.clusters == b.clusters && a.clMap == b.clMap && a.p == b.p && a.id == b.id;
+            ok = ok && std::fabs(a.pClusters - b.pClusters) <= 1e-6*std::max(1.0, std::fabs((double) a.pClusters));
+        }
+
+        printf("%s: checkpoint save -> load -> continue\n", ok ? "OK" : "FAILED");
+        nFailed += ok ? 0 : 1;
+    }
+
+    return nFailed == 0 ? 0 : 1;
 }